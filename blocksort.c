@@ -24,6 +24,169 @@
 
 #include "bzlib_private.h"
 
+#ifdef BZ_SSE2
+#include <emmintrin.h>
+#endif
+
+/*---------------------------------------------*/
+/*--- Sharing one block's sort among        ---*/
+/*--- helper jobs on the pool               ---*/
+/*---------------------------------------------*/
+
+/*--
+   help[0] runs on the calling thread and help[1 ..
+   nJobs-1] are queued; all of them run the same
+   function on the same pass, handing out work items
+   between themselves with BZ2_poolClaim.  Jobs no
+   thread got round to are withdrawn, not waited for.
+--*/
+static
+void sortShare ( bz_pool*     pool,
+                 bz_sorthelp* help,
+                 Int32        nJobs,
+                 void         (*run)( bz_job* ),
+                 void*        pass )
+{
+   Int32 h;
+
+   for (h = 0; h < nJobs; h++) {
+      help[h].job.run = run;
+      help[h].job.arg = &help[h];
+      help[h].pass    = pass;
+      help[h].work    = 0;
+      if (h > 0) BZ2_poolSubmit ( pool, &help[h].job );
+   }
+   run ( &help[0].job );
+   for (h = 1; h < nJobs; h++)
+      BZ2_poolCancel ( pool, &help[h].job );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   A counting sort of positions 0 .. nblock-1 by a key of
+   one byte, or of two for block[i] and block[i+1] (so
+   block[nblock] must repeat block[0]), split into chunks
+   of positions which are counted, then scattered, in
+   parallel.  Each chunk has a row of counters in hist;
+   merging the rows turns them into the place each chunk
+   starts writing in every bucket, in chunk order, so
+   ptr comes out just as one pass would leave it, with
+   positions in a bucket ascending if up, else descending.
+--*/
+
+typedef
+   struct {
+      UChar*   block;
+      Int32    nblock;
+      Int32    nKeys;
+      Bool     up;
+      UInt32*  ptr;
+      UInt32*  hist;
+      Int32    nChunks;
+      Bool     scatter;
+      bz_pool* pool;
+      Int32    next;
+   }
+   RadixPass;
+
+#define RADIX_KEY(i) \
+   ((rp->nKeys == 256) ? block[i] : (block[i] << 8) | block[(i)+1])
+
+/*-- fewest positions a chunk may have, so merging pays --*/
+#define RADIX_CHUNK_MIN(nKeys) (2 * (nKeys) + 16384)
+
+static
+void radixJob ( bz_job* j )
+{
+   RadixPass* rp    = (RadixPass*)((bz_sorthelp*)j->arg)->pass;
+   UChar*     block = rp->block;
+   UInt32*    ptr   = rp->ptr;
+   UInt32*    row;
+   Int32      c, i, lo, hi;
+
+   while (True) {
+      c = BZ2_poolClaim ( rp->pool, &rp->next );
+      if (c >= rp->nChunks) break;
+      lo  = (Int32)(((double)rp->nblock * c)     / rp->nChunks);
+      hi  = (Int32)(((double)rp->nblock * (c+1)) / rp->nChunks);
+      row = rp->hist + c * rp->nKeys;
+
+      if (!rp->scatter) {
+         for (i = 0; i < rp->nKeys; i++) row[i] = 0;
+         for (i = lo; i < hi; i++) row[RADIX_KEY(i)]++;
+      } else if (rp->up) {
+         for (i = lo; i < hi; i++) ptr[ row[RADIX_KEY(i)]++ ] = (UInt32)i;
+      } else {
+         for (i = lo; i < hi; i++) ptr[ --row[RADIX_KEY(i)] ] = (UInt32)i;
+      }
+   }
+}
+
+#undef RADIX_KEY
+
+
+/*-- Post: ftab [0 .. nKeys-1] holds the first loc of each
+           bucket, and ftab [nKeys] holds nblock --*/
+static
+void radixSort ( RadixPass*   rp,
+                 UInt32*      ftab,
+                 bz_sorthelp* help )
+{
+   Int32   b, c;
+   UInt32  t;
+   UInt32* row;
+
+   rp->scatter = False;
+   rp->next    = 0;
+   sortShare ( rp->pool, help, rp->nChunks, radixJob, rp );
+
+   /*-- bucket ends first, then back off chunk by chunk --*/
+   for (b = 0; b < rp->nKeys; b++) ftab[b] = 0;
+   for (c = 0; c < rp->nChunks; c++) {
+      row = rp->hist + c * rp->nKeys;
+      for (b = 0; b < rp->nKeys; b++) ftab[b] += row[b];
+   }
+   t = 0;
+   for (b = 0; b < rp->nKeys; b++) { t += ftab[b]; ftab[b] = t; }
+
+   for (c = 0; c < rp->nChunks; c++) {
+      row = rp->hist + (rp->up ? rp->nChunks - 1 - c : c) * rp->nKeys;
+      for (b = 0; b < rp->nKeys; b++) {
+         t = row[b];
+         if (rp->up) {
+            ftab[b] -= t; row[b] = ftab[b];
+         } else {
+            row[b] = ftab[b]; ftab[b] -= t;
+         }
+      }
+   }
+   ftab[rp->nKeys] = (UInt32)rp->nblock;
+
+   rp->scatter = True;
+   rp->next    = 0;
+   sortShare ( rp->pool, help, rp->nChunks, radixJob, rp );
+}
+
+
+/*-- how many chunks to split a radix sort into, or 1 --*/
+static
+Int32 radixChunks ( bz_pool* pool,
+                    Int32    nHelp,
+                    Int32    nblock,
+                    Int32    nKeys,
+                    Int32    histWords )
+{
+   Int32 n = nHelp + 1;
+
+   if (pool == NULL) return 1;
+   if (n > histWords / nKeys) n = histWords / nKeys;
+   if (n > nblock / RADIX_CHUNK_MIN(nKeys))
+      n = nblock / RADIX_CHUNK_MIN(nKeys);
+   return (n < 2) ? 1 : n;
+}
+
+
 /*---------------------------------------------*/
 /*--- Fallback O(N log(N)^2) sorting        ---*/
 /*--- algorithm, for repetitive blocks      ---*/
@@ -212,11 +375,14 @@ void fallbackQSort3 ( UInt32* fmap,
 #define UNALIGNED_BH(zz)  ((zz) & 0x01f)
 
 static
-void fallbackSort ( UInt32* fmap,
-                    UInt32* eclass,
-                    UInt32* bhtab,
-                    Int32   nblock,
-                    Int32   verb )
+void fallbackSort ( UInt32*      fmap,
+                    UInt32*      eclass,
+                    UInt32*      bhtab,
+                    Int32        nblock,
+                    Int32        verb,
+                    bz_pool*     pool,
+                    bz_sorthelp* help,
+                    Int32        nHelp )
 {
    Int32 ftab[257];
    Int32 ftabCopy[256];
@@ -224,6 +390,7 @@ void fallbackSort ( UInt32* fmap,
    Int32 nNotDone;
    Int32 nBhtab;
    UChar* eclass8 = (UChar*)eclass;
+   RadixPass rp;
 
    /*--
       Initial 1-char radix sort to generate
@@ -231,16 +398,30 @@ void fallbackSort ( UInt32* fmap,
    --*/
    if (verb >= 4)
       VPrintf0 ( "        bucket sorting ...\n" );
-   for (i = 0; i < 257;    i++) ftab[i] = 0;
-   for (i = 0; i < nblock; i++) ftab[eclass8[i]]++;
-   for (i = 0; i < 256;    i++) ftabCopy[i] = ftab[i];
-   for (i = 1; i < 257;    i++) ftab[i] += ftab[i-1];
+   rp.nChunks = radixChunks ( pool, nHelp, nblock, 256, 65537 );
+   if (rp.nChunks > 1) {
+      /*-- bhtab is free until the BH bits go in --*/
+      rp.block  = eclass8;
+      rp.nblock = nblock;
+      rp.nKeys  = 256;
+      rp.up     = False;
+      rp.ptr    = fmap;
+      rp.hist   = bhtab;
+      rp.pool   = pool;
+      radixSort ( &rp, (UInt32*)ftab, help );
+      for (i = 0; i < 256; i++) ftabCopy[i] = ftab[i+1] - ftab[i];
+   } else {
+      for (i = 0; i < 257;    i++) ftab[i] = 0;
+      for (i = 0; i < nblock; i++) ftab[eclass8[i]]++;
+      for (i = 0; i < 256;    i++) ftabCopy[i] = ftab[i];
+      for (i = 1; i < 257;    i++) ftab[i] += ftab[i-1];
 
-   for (i = 0; i < nblock; i++) {
-      j = eclass8[i];
-      k = ftab[j] - 1;
-      ftab[j] = k;
-      fmap[k] = i;
+      for (i = 0; i < nblock; i++) {
+         j = eclass8[i];
+         k = ftab[j] - 1;
+         ftab[j] = k;
+         fmap[k] = i;
+      }
    }
 
    nBhtab = 2 + (nblock / 32);
@@ -345,6 +526,102 @@ void fallbackSort ( UInt32* fmap,
 /*---------------------------------------------*/
 
 /*---------------------------------------------*/
+#ifdef BZ_SSE2
+
+/*--
+   The same comparison, 16 positions at a time.  The
+   first step covers the 12 block bytes which have no
+   quadrant check; then each step compares 16 bytes of
+   block and 16 quadrant entries, and the first position
+   where either differs decides.  Budget is charged per
+   8 positions passed, as in the plain version.
+
+   Loads run up to 15 positions beyond i1 and i2 without
+   wrapping.  Callers pass positions up to nblock + d,
+   d being the depth already sorted on, so both are first
+   brought back below nblock.  After that they are below
+   nblock + 12 at the start of every step, and the loads
+   stay inside the BZ_N_OVERSHOOT copies at the end of
+   block and quadrant, which hold the same values as the
+   wrapped positions.
+--*/
+#define MAIN_GTU_NEQ8(a1,a2)                             \
+   (~(UInt32)_mm_movemask_epi8 (                        \
+      _mm_cmpeq_epi8 ( _mm_loadu_si128((__m128i*)(a1)), \
+                       _mm_loadu_si128((__m128i*)(a2)) ) ))
+
+#define MAIN_GTU_NEQ16(a1,a2)                           \
+   _mm_cmpeq_epi16 ( _mm_loadu_si128((__m128i*)(a1)),   \
+                     _mm_loadu_si128((__m128i*)(a2)) )
+
+static
+__inline__
+Bool mainGtU ( UInt32  i1,
+               UInt32  i2,
+               UChar*  block,
+               UInt16* quadrant,
+               UInt32  nblock,
+               Int32*  budget )
+{
+   Int32  k;
+   UInt32 d, m, mq;
+
+   AssertD ( i1 != i2, "mainGtU" );
+   if (i1 >= nblock) i1 -= nblock;
+   if (i2 >= nblock) i2 -= nblock;
+   m = MAIN_GTU_NEQ8 ( &block[i1], &block[i2] ) & 0xfff;
+   if (m != 0) {
+      d = (UInt32)__builtin_ctz ( m );
+      return (block[i1+d] > block[i2+d]);
+   }
+   i1 += 12; i2 += 12;
+
+   /*-- groups of 8 positions the plain loop would visit --*/
+   k = (Int32)((nblock + 8) / 8 + 1);
+
+   while (k >= 2) {
+      m  = MAIN_GTU_NEQ8 ( &block[i1], &block[i2] ) & 0xffff;
+      mq = ~(UInt32)_mm_movemask_epi8 ( _mm_packs_epi16 (
+              MAIN_GTU_NEQ16 ( &quadrant[i1],   &quadrant[i2] ),
+              MAIN_GTU_NEQ16 ( &quadrant[i1+8], &quadrant[i2+8] ) ) )
+           & 0xffff;
+      if ((m | mq) != 0) {
+         d = (UInt32)__builtin_ctz ( m | mq );
+         (*budget) -= (Int32)(d / 8);
+         if (m & (1U << d))
+            return (block[i1+d] > block[i2+d]); else
+            return (quadrant[i1+d] > quadrant[i2+d]);
+      }
+      i1 += 16; i2 += 16;
+      if (i1 >= nblock) i1 -= nblock;
+      if (i2 >= nblock) i2 -= nblock;
+      k -= 2;
+      (*budget) -= 2;
+   }
+
+   if (k == 1) {
+      m  = MAIN_GTU_NEQ8 ( &block[i1], &block[i2] ) & 0xff;
+      mq = ~(UInt32)_mm_movemask_epi8 ( _mm_packs_epi16 (
+              MAIN_GTU_NEQ16 ( &quadrant[i1], &quadrant[i2] ),
+              _mm_setzero_si128 () ) )
+           & 0xff;
+      if ((m | mq) != 0) {
+         d = (UInt32)__builtin_ctz ( m | mq );
+         if (m & (1U << d))
+            return (block[i1+d] > block[i2+d]); else
+            return (quadrant[i1+d] > quadrant[i2+d]);
+      }
+      (*budget)--;
+   }
+
+   return False;
+}
+
+#undef MAIN_GTU_NEQ8
+#undef MAIN_GTU_NEQ16
+
+#else
+
 static
 __inline__
 Bool mainGtU ( UInt32  i1,
@@ -471,6 +748,8 @@ Bool mainGtU ( UInt32  i1,
    return False;
 }
 
+#endif
+
 
 /*---------------------------------------------*/
 /*--
@@ -746,29 +1025,153 @@ void mainQSort3 ( UInt32* ptr,
       if (*budget < 0), sorting was abandoned
 */
 
+/*--
+   Step 1 of mainSort, below, quicksorts a list of small
+   buckets which have nothing to do with each other: each
+   reads only block and quadrant, which stay put until
+   the list is done, and writes only its own part of ptr.
+   So the list can be shared out among helper jobs.
+
+   Each job charges its buckets against the budget left
+   when the list began, and stops once it has run through
+   that.  The sorting is abandoned if the jobs' work adds
+   up to more than the budget, which is exactly when the
+   buckets done one after another would have run out, so
+   the choice of fallback, and hence the output, does not
+   depend on how the buckets were shared.
+--*/
+
+typedef
+   struct {
+      UInt32*  ptr;
+      UChar*   block;
+      UInt16*  quadrant;
+      Int32    nblock;
+      Int32    budget;
+      bz_pool* pool;
+      Int32    next;
+      Int32    nSorts;
+      Int32    lo[256];
+      Int32    hi[256];
+   }
+   MainPass;
+
+/*-- pointers to sort per helper, below which it isn't worth one --*/
+#define MAIN_PASS_SHARE 8192
+
+static
+void mainPassWork ( MainPass* ps, Int32* work )
+{
+   Int32 k, b;
+
+   while (True) {
+      if (ps->pool != NULL)
+         k = BZ2_poolClaim ( ps->pool, &ps->next ); else
+         k = ps->next++;
+      if (k >= ps->nSorts) break;
+      b = ps->budget - *work;
+      mainQSort3 (
+         ps->ptr, ps->block, ps->quadrant, ps->nblock,
+         ps->lo[k], ps->hi[k], BZ_N_RADIX, &b
+      );
+      *work = ps->budget - b;
+      if (b < 0) break;
+   }
+}
+
+
+static
+void mainPassJob ( bz_job* j )
+{
+   bz_sorthelp* h = (bz_sorthelp*)j->arg;
+   mainPassWork ( (MainPass*)h->pass, &h->work );
+}
+
+
+static
+void mainPassRun ( MainPass*    ps,
+                   bz_sorthelp* help,
+                   Int32        nHelp,
+                   Int32        numToSort,
+                   Int32*       budget )
+{
+   Int32 h, work;
+
+   if (ps->pool == NULL) nHelp = 0;
+   if (nHelp > ps->nSorts - 1) nHelp = ps->nSorts - 1;
+   if (nHelp > numToSort / MAIN_PASS_SHARE)
+      nHelp = numToSort / MAIN_PASS_SHARE;
+
+   ps->budget = *budget;
+   ps->next   = 0;
+   work       = 0;
+   if (nHelp == 0) {
+      mainPassWork ( ps, &work );
+   } else {
+      sortShare ( ps->pool, help, nHelp + 1, mainPassJob, ps );
+      for (h = 0; h <= nHelp; h++) {
+         work += help[h].work;
+         if (work > ps->budget) work = ps->budget + 1;
+      }
+   }
+   *budget -= work;
+}
+
+
 #define BIGFREQ(b) (ftab[((b)+1) << 8] - ftab[(b) << 8])
 #define SETMASK (1 << 21)
 #define CLEARMASK (~(SETMASK))
 
 static
-void mainSort ( UInt32* ptr,
-                UChar*  block,
-                UInt16* quadrant,
-                UInt32* ftab,
-                Int32   nblock,
-                Int32   verb,
-                Int32*  budget )
+void mainSort ( UInt32*      ptr,
+                UChar*       block,
+                UInt16*      quadrant,
+                UInt32*      ftab,
+                Int32        nblock,
+                Int32        verb,
+                Int32*       budget,
+                bz_pool*     pool,
+                bz_sorthelp* help,
+                Int32        nHelp )
 {
-   Int32  i, j, k, ss, sb;
-   Int32  runningOrder[256];
-   Bool   bigDone[256];
-   Int32  copyStart[256];
-   Int32  copyEnd  [256];
-   UChar  c1;
-   Int32  numQSorted;
-   UInt16 s;
+   Int32    i, j, k, ss, sb;
+   Int32    runningOrder[256];
+   Bool     bigDone[256];
+   Int32    copyStart[256];
+   Int32    copyEnd  [256];
+   UChar    c1;
+   Int32    numQSorted, numToSort;
+   UInt16    s;
+   MainPass  ps;
+   RadixPass rp;
    if (verb >= 4) VPrintf0 ( "        main sort initialise ...\n" );
 
+   /*--
+      With helpers to hand, the initial radix sort is split
+      among them, keeping the counters in the quadrant area
+      until it is cleared.
+   --*/
+   j = (nblock + BZ_N_OVERSHOOT + 3) & ~3;
+   rp.nChunks = radixChunks ( pool, nHelp, nblock, 65536,
+                              nblock + BZ_N_OVERSHOOT - j / 4 );
+   if (rp.nChunks > 1) {
+      for (i = 0; i < BZ_N_OVERSHOOT; i++)
+         block[nblock+i] = block[i];
+
+      if (verb >= 4) VPrintf0 ( "        bucket sorting ...\n" );
+      rp.block  = block;
+      rp.nblock = nblock;
+      rp.nKeys  = 65536;
+      rp.up     = True;
+      rp.ptr    = ptr;
+      rp.hist   = (UInt32*)(&block[j]);
+      rp.pool   = pool;
+      radixSort ( &rp, ftab, help );
+
+      for (i = 0; i < nblock + BZ_N_OVERSHOOT; i++) quadrant[i] = 0;
+      goto bucketsDone;
+   }
+
    /*-- set up the 2-byte frequency table --*/
    for (i = 65536; i >= 0; i--) ftab[i] = 0;
 
@@ -832,6 +1235,8 @@ void mainSort ( UInt32* ptr,
       ptr[j] = i;
    }
 
+   bucketsDone:
+
    /*--
       Now ftab contains the first loc of every small bucket.
       Calculate the running order, from smallest to largest
@@ -866,7 +1271,12 @@ void mainSort ( UInt32* ptr,
       The main sorting loop.
    --*/
 
-   numQSorted = 0;
+   numQSorted  = 0;
+   ps.ptr      = ptr;
+   ps.block    = block;
+   ps.quadrant = quadrant;
+   ps.nblock   = nblock;
+   ps.pool     = pool;
 
    for (i = 0; i <= 255; i++) {
 
@@ -884,8 +1294,11 @@ void mainSort ( UInt32* ptr,
          any unsorted small buckets [ss, j], for j != ss.
          Hopefully previous pointer-scanning phases have already
          completed many of the small buckets [ss, j], so
-         we don't have to sort them at all.
+         we don't have to sort them at all.  Those that are
+         left are listed, then sorted by mainPassRun.
       --*/
+      ps.nSorts = 0;
+      numToSort = 0;
       for (j = 0; j <= 255; j++) {
          if (j != ss) {
             sb = (ss << 8) + j;
@@ -896,18 +1309,22 @@ void mainSort ( UInt32* ptr,
                   if (verb >= 4)
                      VPrintf4 ( "        qsort [0x%x, 0x%x]   "
                                 "done %d   this %d\n",
-                                ss, j, numQSorted, hi - lo + 1 );
-                  mainQSort3 (
-                     ptr, block, quadrant, nblock,
-                     lo, hi, BZ_N_RADIX, budget
-                  );
-                  numQSorted += (hi - lo + 1);
-                  if (*budget < 0) return;
+                                ss, j, numQSorted + numToSort,
+                                hi - lo + 1 );
+                  ps.lo[ps.nSorts] = lo;
+                  ps.hi[ps.nSorts] = hi;
+                  ps.nSorts++;
+                  numToSort += (hi - lo + 1);
                }
             }
             ftab[sb] |= SETMASK;
          }
       }
+      if (ps.nSorts > 0) {
+         mainPassRun ( &ps, help, nHelp, numToSort, budget );
+         numQSorted += numToSort;
+         if (*budget < 0) return;
+      }
 
       AssertH ( !bigDone[ss], 1006 );
 
@@ -1018,12 +1435,223 @@ void mainSort ( UInt32* ptr,
 #undef CLEARMASK
 
 
+/*---------------------------------------------*/
+/*--- Linear-time sort, by induced sorting  ---*/
+/*--- of suffixes (SA-IS, Nong, Zhang and   ---*/
+/*--- Chan, 2009)                           ---*/
+/*---------------------------------------------*/
+
+/*--
+   The block sort orders rotations, not suffixes, but for
+   a Lyndon word (one strictly less than all its
+   rotations) the two orders are the same.  So the block
+   is rotated to start at its least rotation and, if it is
+   l repeated q times, the suffixes of l are sorted; each
+   then stands for q equal rotations.  Suffixes are
+   sorted with an implicit sentinel at position n, below
+   every symbol.
+
+   Work space, from s->sais, is one bit per position for
+   the L/S types plus one bucket array per level, and
+   level 1 onwards is at most half the size of the level
+   above, so BZ_SAIS_WORDS(n) words always suffice.
+--*/
+
+#define SA_CHR(i) \
+   ((cs == 1) ? (Int32)((UChar*)str)[i] : ((Int32*)str)[i])
+
+#define SA_ISS(i)     ((typ[(i) >> 3] >> ((i) & 7)) & 1)
+#define SA_SETS(i)    typ[(i) >> 3] |= (UChar)(1 << ((i) & 7))
+#define SA_ISLMS(i)   ((i) > 0 && (i) < n && SA_ISS(i) && !SA_ISS((i)-1))
+
+
+/*---------------------------------------------*/
+static
+void saisBuckets ( void* str, Int32 cs, Int32 n,
+                   Int32* bkt, Int32 K, Bool end )
+{
+   Int32 i, sum = 0;
+
+   for (i = 0; i <= K; i++) bkt[i] = 0;
+   for (i = 0; i < n; i++) bkt[SA_CHR(i)]++;
+   for (i = 0; i <= K; i++) {
+      sum += bkt[i];
+      bkt[i] = end ? sum : sum - bkt[i];
+   }
+}
+
+
+/*---------------------------------------------*/
+static
+void saisInduce ( void* str, Int32 cs, Int32* SA, Int32 n,
+                  Int32* bkt, Int32 K, UChar* typ )
+{
+   Int32 i, j;
+
+   /*-- L-type suffixes, left to right; the sentinel comes
+        first and puts suffix n-1, always L-type, in place --*/
+   saisBuckets ( str, cs, n, bkt, K, False );
+   SA[bkt[SA_CHR(n-1)]++] = n-1;
+   for (i = 0; i < n; i++) {
+      j = SA[i] - 1;
+      if (j >= 0 && !SA_ISS(j)) SA[bkt[SA_CHR(j)]++] = j;
+   }
+
+   /*-- S-type suffixes, right to left --*/
+   saisBuckets ( str, cs, n, bkt, K, True );
+   for (i = n-1; i >= 0; i--) {
+      j = SA[i] - 1;
+      if (j >= 0 && SA_ISS(j)) SA[--bkt[SA_CHR(j)]] = j;
+   }
+}
+
+
+/*---------------------------------------------*/
+static
+void sais ( void* str, Int32 cs, Int32* SA, Int32 n, Int32 K,
+            UInt32* work )
+{
+   UChar*  typ = (UChar*)work;
+   Int32*  bkt = (Int32*)(work + (n + 31) / 32);
+   UInt32* rest = (UInt32*)(bkt + K + 1);
+   Int32*  s1;
+   Int32   i, j, d, n1, name, pos, prev;
+   Bool    diff;
+
+   /*-- classify; n-1 is L-type as the sentinel is smaller --*/
+   for (i = 0; i < (n + 7) / 8; i++) typ[i] = 0;
+   for (i = n-2; i >= 0; i--)
+      if (SA_CHR(i) < SA_CHR(i+1) ||
+          (SA_CHR(i) == SA_CHR(i+1) && SA_ISS(i+1))) SA_SETS(i);
+
+   /*-- stage 1: sort the LMS substrings --*/
+   saisBuckets ( str, cs, n, bkt, K, True );
+   for (i = 0; i < n; i++) SA[i] = -1;
+   for (i = 1; i < n; i++)
+      if (SA_ISLMS(i)) SA[--bkt[SA_CHR(i)]] = i;
+   saisInduce ( str, cs, SA, n, bkt, K, typ );
+
+   n1 = 0;
+   for (i = 0; i < n; i++)
+      if (SA_ISLMS(SA[i])) SA[n1++] = SA[i];
+   if (n1 == 0) return;
+
+   /*-- name them; the one running into the sentinel is unique --*/
+   for (i = n1; i < n; i++) SA[i] = -1;
+   name = 0;
+   prev = -1;
+   for (i = 0; i < n1; i++) {
+      pos  = SA[i];
+      diff = False;
+      for (d = 0; ; d++) {
+         if (prev == -1 || pos+d == n || prev+d == n ||
+             SA_CHR(pos+d) != SA_CHR(prev+d) ||
+             SA_ISS(pos+d) != SA_ISS(prev+d)) { diff = True; break; }
+         if (d > 0 && (SA_ISLMS(pos+d) || SA_ISLMS(prev+d))) break;
+      }
+      if (diff) { name++; prev = pos; }
+      SA[n1 + pos / 2] = name - 1;
+   }
+   for (i = n-1, j = n-1; i >= n1; i--)
+      if (SA[i] >= 0) SA[j--] = SA[i];
+
+   /*-- stage 2: sort the reduced string, recursing if need be --*/
+   s1 = SA + n - n1;
+   if (name < n1)
+      sais ( s1, 4, SA, n1, name - 1, rest ); else
+      for (i = 0; i < n1; i++) SA[s1[i]] = i;
+
+   /*-- stage 3: induce the full order from the sorted LMS --*/
+   for (i = 1, j = 0; i < n; i++)
+      if (SA_ISLMS(i)) s1[j++] = i;
+   for (i = 0; i < n1; i++) SA[i] = s1[SA[i]];
+   for (i = n1; i < n; i++) SA[i] = -1;
+   saisBuckets ( str, cs, n, bkt, K, True );
+   for (i = n1-1; i >= 0; i--) {
+      j = SA[i];
+      SA[i] = -1;
+      SA[--bkt[SA_CHR(j)]] = j;
+   }
+   saisInduce ( str, cs, SA, n, bkt, K, typ );
+}
+
+#undef SA_CHR
+#undef SA_ISS
+#undef SA_SETS
+#undef SA_ISLMS
+
+
+/*---------------------------------------------*/
+/* Pre:
+      nblock > 0
+      block [0 .. nblock-1] holds the block, and
+      block [nblock .. 4*nblock-1] may be used
+      work holds BZ_SAIS_WORDS(nblock) words
+   Post:
+      ptr [0 .. nblock-1] holds sorted order, or
+      False if the block is one string repeated
+
+   Equal rotations of a repeated string end up in whatever
+   order the usual sort leaves them, which decides which of
+   them origPtr names, so such blocks are left to it.
+*/
+static
+Bool linearSort ( UInt32* ptr,
+                  UChar*  block,
+                  UInt32* work,
+                  Int32   nblock,
+                  Int32   verb )
+{
+   Int32  i, j, k, r, p;
+   Int32  a, b;
+   UChar* lyn;
+
+   if (verb >= 4) VPrintf0 ( "        finding least rotation ...\n" );
+
+   /*-- least rotation, comparing two candidates at a time --*/
+   i = 0; j = 1; k = 0;
+   while (i < nblock && j < nblock && k < nblock) {
+      a = block[(i + k) % nblock];
+      b = block[(j + k) % nblock];
+      if (a == b) { k++; continue; }
+      if (a > b) i += k + 1; else j += k + 1;
+      if (i == j) j++;
+      k = 0;
+   }
+   r = (i < j) ? i : j;
+
+   lyn = &block[nblock];
+   for (i = 0; i < nblock; i++)
+      lyn[i] = block[(i + r) % nblock];
+
+   /*-- the rotated block is l^q, l a Lyndon word; find |l| --*/
+   k = 0;
+   for (j = 1; j < nblock && lyn[k] <= lyn[j]; j++)
+      if (lyn[k] < lyn[j]) k = 0; else k++;
+   p = j - k;
+   if (j == nblock && p < nblock && nblock % p == 0) {
+      if (verb >= 2)
+         VPrintf1 ( "    repeats with period %d; using the usual"
+                    " sorting algorithm\n", p );
+      return False;
+   }
+
+   if (verb >= 4) VPrintf1 ( "        sorting %d suffixes ...\n", nblock );
+   sais ( lyn, 1, (Int32*)ptr, nblock, 255, work );
+
+   for (i = 0; i < nblock; i++)
+      ptr[i] = (UInt32)(((Int32)ptr[i] + r) % nblock);
+   return True;
+}
+
+
 /*---------------------------------------------*/
 /* Pre:
       nblock > 0
       arr2 exists for [0 .. nblock-1 +N_OVERSHOOT]
       ((UChar*)arr2)  [0 .. nblock-1] holds block
       arr1 exists for [0 .. nblock-1]
+      sais exists if workFactor is BZ_WORKFACTOR_LINEAR
 
    Post:
       ((UChar*)arr2) [0 .. nblock-1] holds block
@@ -1044,8 +1672,14 @@ void BZ2_blockSort ( EState* s )
    Int32   budgetInit;
    Int32   i;
 
+   if (wfact == BZ_WORKFACTOR_LINEAR) {
+      if (linearSort ( ptr, block, s->sais, nblock, verb )) goto sorted;
+      wfact = 30;
+   }
+
    if (nblock < 10000) {
-      fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
+      fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb,
+                     NULL, NULL, 0 );
    } else {
       /* Calculate the location for quadrant, remembering to get
          the alignment right.  Assumes that &(block[0]) is at least
@@ -1068,7 +1702,8 @@ void BZ2_blockSort ( EState* s )
       budgetInit = nblock * ((wfact-1) / 3);
       budget = budgetInit;
 
-      mainSort ( ptr, block, quadrant, ftab, nblock, verb, &budget );
+      mainSort ( ptr, block, quadrant, ftab, nblock, verb, &budget,
+                 s->sortPool, s->sortHelp, s->nSortHelp );
       if (verb >= 3)
          VPrintf3 ( "      %d work, %d block, ratio %5.2f\n",
                     budgetInit - budget,
@@ -1079,10 +1714,12 @@ void BZ2_blockSort ( EState* s )
          if (verb >= 2)
             VPrintf0 ( "    too repetitive; using fallback"
                        " sorting algorithm\n" );
-         fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb );
+         fallbackSort ( s->arr1, s->arr2, ftab, nblock, verb,
+                        s->sortPool, s->sortHelp, s->nSortHelp );
       }
    }
 
+   sorted:
    s->origPtr = -1;
    for (i = 0; i < s->nblock; i++)
       if (ptr[i] == 0)
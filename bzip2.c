@@ -53,6 +53,39 @@
 #   include <sys/stat.h>
 #   include <sys/times.h>
 
+#   if !defined(__DJGPP__) && !defined(BZ_NO_MMAP)
+#      include <sys/mman.h>
+#      define BZ_MMAP 1
+#   endif
+
+#   if !defined(__DJGPP__) && !defined(BZ_NO_THREADS)
+#      include <pthread.h>
+#      define BZ_PIPE_IO 1
+#      if defined(__linux__) && defined(BZ_MMAP) && \
+          defined(SPLICE_F_GIFT) && defined(F_GETPIPE_SZ)
+#         include <sys/uio.h>
+#         define BZ_VMSPLICE 1
+#      endif
+#   endif
+
+#   if !defined(__DJGPP__)
+#      include <dirent.h>
+#      include <poll.h>
+#      include <sys/wait.h>
+#      define BZ_BATCH 1
+#   endif
+
+#   if defined(__linux__) && defined(BZ_MMAP) && \
+       !defined(BZ_NO_URING) && defined(__has_include)
+#      if __has_include(<linux/io_uring.h>)
+#         include <linux/io_uring.h>
+#         include <sys/syscall.h>
+#         if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#            define BZ_URING 1
+#         endif
+#      endif
+#   endif
+
 #   define PATH_SEP    '/'
 #   define MY_LSTAT    lstat
 #   define MY_STAT     stat
@@ -167,8 +200,9 @@ typedef int IntNative;
 /*---------------------------------------------------*/
 
 Int32   verbosity;
-Bool    keepInputFiles, smallMode, deleteOutputOnInterrupt;
+Bool    keepInputFiles, smallMode, wideMode, deleteOutputOnInterrupt;
 Bool    forceOverwrite, testFailsExist, unzFailsExist, noisy;
+Bool    spliceMode, recursive;
 Int32   numFileNames, numFilesProcessed, blockSize100k;
 Int32   exitValue;
 
@@ -195,6 +229,7 @@ Char    *progName;
 Char    progNameReally[FILE_NAME_LEN];
 FILE    *outputHandleJustInCase;
 Int32   workFactor;
+Int32   numThreads;
 
 static void    panic                 ( const Char* ) NORETURN;
 static void    ioError               ( void )        NORETURN;
@@ -207,6 +242,10 @@ static void    compressedStreamEOF   ( void )        NORETURN;
 static void    copyFileName ( Char*, Char* );
 static void*   myMalloc     ( Int32 );
 static void    applySavedFileAttrToOutputFile ( IntNative fd );
+static void    mySIGSEGVorSIGBUScatcher ( IntNative );
+#ifdef BZ_BATCH
+static void    stopJobs     ( IntNative );
+#endif
 
 
 
@@ -258,57 +297,1253 @@ Bool uInt64_isZero ( UInt64* n )
 }
 
 
-/* Divide *n by 10, and return the remainder.  */
+/* Divide *n by 10, and return the remainder.  */
+static
+Int32 uInt64_qrm10 ( UInt64* n )
+{
+   UInt32 rem, tmp;
+   Int32  i;
+   rem = 0;
+   for (i = 7; i >= 0; i--) {
+      tmp = rem * 256 + n->b[i];
+      n->b[i] = tmp / 10;
+      rem = tmp % 10;
+   }
+   return rem;
+}
+
+
+/* ... and the Whole Entire Point of all this UInt64 stuff is
+   so that we can supply the following function.
+*/
+static
+void uInt64_toAscii ( char* outbuf, UInt64* n )
+{
+   Int32  i, q;
+   UChar  buf[32];
+   Int32  nBuf   = 0;
+   UInt64 n_copy = *n;
+   do {
+      q = uInt64_qrm10 ( &n_copy );
+      buf[nBuf] = q + '0';
+      nBuf++;
+   } while (!uInt64_isZero(&n_copy));
+   outbuf[nBuf] = 0;
+   for (i = 0; i < nBuf; i++)
+      outbuf[i] = buf[nBuf-i-1];
+}
+
+
+/*---------------------------------------------------*/
+/*--- Processing of complete files and streams    ---*/
+/*---------------------------------------------------*/
+
+/*---------------------------------------------*/
+static
+Bool myfeof ( FILE* f )
+{
+   Int32 c = fgetc ( f );
+   if (c == EOF) return True;
+   ungetc ( c, f );
+   return False;
+}
+
+
+#if defined(BZ_MMAP) || defined(BZ_PIPE_IO) || defined(BZ_URING)
+#define BZ_DIRECT_IO 1
+#endif
+
+#ifdef BZ_DIRECT_IO
+
+/*--
+   Where the input can be mapped, or read and written
+   by threads of our own, compressStream and friends
+   drive a bz_stream directly rather than go through
+   BZ2_bzWrite/BZ2_bzRead and 5000-byte stdio calls.
+   Both sides move data BZ_IO_CHUNK bytes at a time.
+--*/
+#define BZ_IO_CHUNK  (1 << 20)
+#define BZ_IO_SLOTS  4
+
+
+#ifdef BZ_PIPE_IO
+
+/*---------------------------------------------*/
+/*--
+   BZ_IO_SLOTS chunks passed from one thread which
+   fills them to one which empties them, so that the
+   input is read, and the output written, while the
+   block sorting and unBWT get on with it.  put and
+   got count the chunks filled and emptied so far,
+   and taken those the emptying side has started on;
+   either side only waits when the other is a whole
+   ring ahead of it, or has nothing for it yet.
+--*/
+typedef
+   struct {
+      UChar*          buf[BZ_IO_SLOTS];
+      UInt32          len[BZ_IO_SLOTS];
+      UInt32          put;
+      UInt32          got;
+      UInt32          taken;
+#ifdef BZ_VMSPLICE
+      Int32           pipeSize;  /*-- > 0 while vmsplice'ing --*/
+      Bool            mapped;    /*-- buf[] came from mmap --*/
+      UInt32          out;       /*-- bytes spliced, mod 2^32 --*/
+      UInt32          sent[BZ_IO_SLOTS];  /*-- out after each chunk --*/
+#endif
+      Bool            done;      /*-- no more will be put --*/
+      Bool            quit;      /*-- no more will be taken --*/
+      Bool            failed;    /*-- the thread's read or write did --*/
+      int             err;       /*-- and its errno, for ioError --*/
+      FILE*           f;
+      pthread_t       thr;
+      pthread_mutex_t lock;
+      pthread_cond_t  cond;
+   }
+   ioRing;
+
+
+/*---------------------------------------------*/
+/*-- The next chunk to fill, or NULL if nobody will take it. --*/
+static
+UChar* ringFree ( ioRing* r )
+{
+   UChar* p;
+
+   pthread_mutex_lock ( &r->lock );
+   while (r->put - r->got == BZ_IO_SLOTS && !r->quit)
+      pthread_cond_wait ( &r->cond, &r->lock );
+   p = r->quit ? NULL : r->buf[r->put % BZ_IO_SLOTS];
+   pthread_mutex_unlock ( &r->lock );
+   return p;
+}
+
+
+static
+void ringPut ( ioRing* r, UInt32 n )
+{
+   pthread_mutex_lock ( &r->lock );
+   r->len[r->put % BZ_IO_SLOTS] = n;
+   r->put++;
+   pthread_cond_broadcast ( &r->cond );
+   pthread_mutex_unlock ( &r->lock );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   The next chunk to empty, or NULL once there are no
+   more.  It stays the taker's until ringGot.
+--*/
+static
+UChar* ringTake ( ioRing* r, UInt32* n )
+{
+   UChar* p = NULL;
+
+   pthread_mutex_lock ( &r->lock );
+   while (r->taken == r->put && !r->done)
+      pthread_cond_wait ( &r->cond, &r->lock );
+   if (r->taken != r->put) {
+      p  = r->buf[r->taken % BZ_IO_SLOTS];
+      *n = r->len[r->taken % BZ_IO_SLOTS];
+      r->taken++;
+   }
+   pthread_mutex_unlock ( &r->lock );
+   return p;
+}
+
+
+static
+void ringGot ( ioRing* r )
+{
+   pthread_mutex_lock ( &r->lock );
+   r->got++;
+   pthread_cond_broadcast ( &r->cond );
+   pthread_mutex_unlock ( &r->lock );
+}
+
+
+/*---------------------------------------------*/
+static
+void ringStop ( ioRing* r, Bool producer, Bool failed )
+{
+   int err = errno;
+
+   pthread_mutex_lock ( &r->lock );
+   if (producer) r->done = True; else r->quit = True;
+   if (failed) { r->failed = True; r->err = err; }
+   pthread_cond_broadcast ( &r->cond );
+   pthread_mutex_unlock ( &r->lock );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Reads with read(2) rather than fread, so that a
+   pipe is passed on as it arrives instead of after a
+   whole chunk.  The read is the only place the thread
+   may be cancelled, which is how ringClose stops one
+   waiting on a pipe that nobody is going to close.
+--*/
+static
+void* readerThread ( void* arg )
+{
+   ioRing* r = (ioRing*)arg;
+   UChar*  p;
+   ssize_t n;
+   int     old;
+   int     fd = fileno ( r->f );
+
+   pthread_setcancelstate ( PTHREAD_CANCEL_DISABLE, &old );
+   while ((p = ringFree ( r )) != NULL) {
+      pthread_setcancelstate ( PTHREAD_CANCEL_ENABLE, &old );
+      do {
+         n = read ( fd, p, BZ_IO_CHUNK );
+      } while (n < 0 && errno == EINTR);
+      pthread_setcancelstate ( PTHREAD_CANCEL_DISABLE, &old );
+      if (n <= 0) { ringStop ( r, True, n < 0 ); return NULL; }
+      ringPut ( r, (UInt32)n );
+   }
+   ringStop ( r, True, False );
+   return NULL;
+}
+
+
+#ifdef BZ_VMSPLICE
+/*---------------------------------------------*/
+/*--
+   For --vmsplice.  The pipe takes references to the
+   pages of a chunk rather than a copy, so the chunk
+   cannot be filled again until they have been read.
+   A pipe holds at most its size in bytes, so once
+   that much more has gone in after a chunk, it has.
+   A reader which splices the pages on somewhere else
+   rather than reading them defeats this, which is
+   why it is not the default.
+--*/
+static
+Int32 spliceSize ( FILE* f )
+{
+   struct MY_STAT statBuf;
+   int            fd = fileno ( f );
+   int            n;
+
+   if (fd < 0 || fstat ( fd, &statBuf ) != 0 ||
+       !S_ISFIFO(statBuf.st_mode)) return 0;
+   (void)fcntl ( fd, F_SETPIPE_SZ, BZ_IO_CHUNK );
+   n = fcntl ( fd, F_GETPIPE_SZ );
+
+   /*-- the writer must never need every chunk held back --*/
+   if (n <= 0 || n > (BZ_IO_SLOTS - 1) * BZ_IO_CHUNK) return 0;
+   return n;
+}
+
+
+/*-- False on a failed vmsplice, errno set. --*/
+static
+Bool spliceOut ( ioRing* r, UChar* p, UInt32 n )
+{
+   struct iovec iov;
+   ssize_t      k;
+
+   iov.iov_base = p;
+   iov.iov_len  = n;
+   while (iov.iov_len > 0) {
+      k = vmsplice ( fileno ( r->f ), &iov, 1, 0 );
+      if (k < 0 && errno == EINTR) continue;
+      if (k < 0) return False;
+      iov.iov_base = (char*)iov.iov_base + k;
+      iov.iov_len -= (size_t)k;
+   }
+   return True;
+}
+#endif
+
+
+static
+void* writerThread ( void* arg )
+{
+   ioRing* r = (ioRing*)arg;
+   UChar*  p;
+   UInt32  n;
+
+   while ((p = ringTake ( r, &n )) != NULL) {
+#     ifdef BZ_VMSPLICE
+      if (r->pipeSize > 0) {
+         if (!spliceOut ( r, p, n )) {
+            /*-- nothing went in yet, so we can still just write --*/
+            if (r->out == 0 && (errno == ENOSYS || errno == EINVAL ||
+                                errno == EPERM))
+               r->pipeSize = 0;
+            else {
+               ringStop ( r, False, True );
+               break;
+            }
+         } else {
+            r->out += n;
+            r->sent[(r->taken - 1) % BZ_IO_SLOTS] = r->out;
+            while (r->got != r->taken &&
+                   r->out - r->sent[r->got % BZ_IO_SLOTS]
+                      >= (UInt32)r->pipeSize)
+               ringGot ( r );
+            continue;
+         }
+      }
+#     endif
+      if (fwrite ( p, sizeof(UChar), n, r->f ) != n || ferror(r->f)) {
+         ringStop ( r, False, True );
+         break;
+      }
+      ringGot ( r );
+   }
+   return NULL;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Allocates or frees the chunks.  For --vmsplice they
+   are whole pages, never handed back to malloc while
+   the pipe may still hold them.
+--*/
+static
+void ringBuffers ( ioRing* r, Bool alloc )
+{
+   Int32 i;
+
+   for (i = 0; i < BZ_IO_SLOTS; i++) {
+#     ifdef BZ_VMSPLICE
+      if (r->mapped) {
+         if (!alloc) {
+            munmap ( r->buf[i], BZ_IO_CHUNK );
+            continue;
+         }
+         r->buf[i] = mmap ( NULL, BZ_IO_CHUNK, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+         if (r->buf[i] == MAP_FAILED) outOfMemory ();
+         continue;
+      }
+#     endif
+      if (alloc) r->buf[i] = myMalloc ( BZ_IO_CHUNK ); else free ( r->buf[i] );
+   }
+}
+
+
+/*---------------------------------------------*/
+/*--
+   NULL if no thread could be started; use the caller's
+   own.  splice asks for --vmsplice, if f is a pipe.
+--*/
+static
+ioRing* ringOpen ( FILE* f, void* (*fn) ( void* ), Bool splice )
+{
+   ioRing* r;
+
+   r = myMalloc ( sizeof(ioRing) );
+#ifdef BZ_VMSPLICE
+   r->pipeSize = splice ? spliceSize ( f ) : 0;
+   r->mapped   = r->pipeSize > 0;
+   r->out      = 0;
+#else
+   (void)splice;
+#endif
+   ringBuffers ( r, True );
+   r->put    = 0;
+   r->got    = 0;
+   r->taken  = 0;
+   r->done   = False;
+   r->quit   = False;
+   r->failed = False;
+   r->err    = 0;
+   r->f      = f;
+   pthread_mutex_init ( &r->lock, NULL );
+   pthread_cond_init ( &r->cond, NULL );
+
+   if (pthread_create ( &r->thr, NULL, fn, r ) != 0) {
+      pthread_cond_destroy ( &r->cond );
+      pthread_mutex_destroy ( &r->lock );
+      ringBuffers ( r, False );
+      free ( r );
+      return NULL;
+   }
+   return r;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Stops r from our side, waits for its thread, and
+   says whether the thread's reads or writes all went
+   through, leaving errno as the thread saw it if not.
+   A writer is left to drain what it has.
+--*/
+static
+Bool ringClose ( ioRing* r, Bool reader )
+{
+   Bool  ok;
+   int   err;
+
+   ringStop ( r, !reader, False );
+   if (reader) pthread_cancel ( r->thr );
+   pthread_join ( r->thr, NULL );
+
+   ok = !r->failed;
+   err = r->err;
+   pthread_cond_destroy ( &r->cond );
+   pthread_mutex_destroy ( &r->lock );
+   ringBuffers ( r, False );
+   free ( r );
+   if (!ok) errno = err;
+   return ok;
+}
+
+#endif /* BZ_PIPE_IO */
+
+
+#ifdef BZ_URING
+
+/*---------------------------------------------*/
+/*--
+   The same chunks passed to the kernel through
+   io_uring instead, where it has one: no threads,
+   and each file costs no more than its reads and
+   writes, since the ring, and the chunks of the
+   last file, are kept for the rest of the run.
+   Only plain reads and writes are used, through the
+   raw system calls, so liburing is not needed.
+--*/
+typedef
+   struct {
+      int                  fd;
+      UInt32*              sqTail;
+      UInt32*              sqMask;
+      UInt32*              sqArray;
+      struct io_uring_sqe* sqes;
+      UInt32*              cqHead;
+      UInt32*              cqTail;
+      UInt32*              cqMask;
+      struct io_uring_cqe* cqes;
+   }
+   uRing;
+
+static uRing uring;
+static Int32 uringState = 0;     /*-- 0 untried, 1 up, -1 not there --*/
+
+
+/*-- One read or write on its way through the ring. --*/
+typedef
+   struct {
+      UChar*  p;
+      UInt32  left;
+      off_t   off;       /*-- -1 for the file position --*/
+      int     fd;
+      Bool    write;
+      Bool    busy;
+      int     err;
+      UInt32  n;         /*-- bytes read --*/
+   }
+   ioSlot;
+
+
+/*---------------------------------------------*/
+/*-- Sets the ring up the first time it is wanted. --*/
+static
+Bool uringStart ( void )
+{
+   struct io_uring_params p;
+   UChar* sq;
+   void*  sqes;
+   size_t nSq, nCq;
+   long   fd;
+
+   if (uringState != 0) return uringState > 0;
+   uringState = -1;
+
+   memset ( &p, 0, sizeof(p) );
+   fd = syscall ( __NR_io_uring_setup, 2 * BZ_IO_SLOTS, &p );
+   if (fd < 0) return False;
+
+   /*-- IORING_OP_READ and _WRITE came along with this --*/
+   if (!(p.features & IORING_FEAT_RW_CUR_POS) ||
+       !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+      close ( (int)fd );
+      return False;
+   }
+
+   nSq = p.sq_off.array + p.sq_entries * sizeof(UInt32);
+   nCq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   sq = mmap ( NULL, nSq > nCq ? nSq : nCq, PROT_READ | PROT_WRITE,
+               MAP_SHARED, (int)fd, IORING_OFF_SQ_RING );
+   if (sq == MAP_FAILED) { close ( (int)fd ); return False; }
+   sqes = mmap ( NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, (int)fd,
+                 IORING_OFF_SQES );
+   if (sqes == MAP_FAILED) {
+      munmap ( sq, nSq > nCq ? nSq : nCq );
+      close ( (int)fd );
+      return False;
+   }
+
+   uring.fd      = (int)fd;
+   uring.sqTail  = (UInt32*)(sq + p.sq_off.tail);
+   uring.sqMask  = (UInt32*)(sq + p.sq_off.ring_mask);
+   uring.sqArray = (UInt32*)(sq + p.sq_off.array);
+   uring.sqes    = (struct io_uring_sqe*)sqes;
+   uring.cqHead  = (UInt32*)(sq + p.cq_off.head);
+   uring.cqTail  = (UInt32*)(sq + p.cq_off.tail);
+   uring.cqMask  = (UInt32*)(sq + p.cq_off.ring_mask);
+   uring.cqes    = (struct io_uring_cqe*)(sq + p.cq_off.cqes);
+   uringState    = 1;
+   return True;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Hands one entry to the kernel.  Nothing is ever
+   left queued between calls, and no more than
+   2 * BZ_IO_SLOTS are out at once, so there is
+   always room for it.
+--*/
+static
+Bool uringSubmit ( UChar opcode, int fd, UChar* p, UInt32 len,
+                   off_t off, void* tag )
+{
+   struct io_uring_sqe* e;
+   UInt32 tail = *uring.sqTail;
+   UInt32 i    = tail & *uring.sqMask;
+   long   r;
+
+   e = &uring.sqes[i];
+   memset ( e, 0, sizeof(*e) );
+   e->opcode    = opcode;
+   e->fd        = fd;
+   e->addr      = (__u64)(size_t)p;
+   e->len       = len;
+   e->off       = (__u64)off;
+   e->user_data = (__u64)(size_t)tag;
+   uring.sqArray[i] = i;
+   __atomic_store_n ( uring.sqTail, tail + 1, __ATOMIC_RELEASE );
+
+   do {
+      r = syscall ( __NR_io_uring_enter, uring.fd, 1, 0, 0, NULL, 0 );
+   } while (r < 0 && errno == EINTR);
+
+   /*-- on failure the kernel took nothing, so take it back --*/
+   if (r < 0) __atomic_store_n ( uring.sqTail, tail, __ATOMIC_RELEASE );
+   return r >= 0;
+}
+
+
+static
+void slotSubmit ( ioSlot* s )
+{
+   s->busy = True;
+   if (!uringSubmit ( s->write ? IORING_OP_WRITE : IORING_OP_READ,
+                      s->fd, s->p, s->left, s->off, s )) {
+      s->err  = errno;
+      s->busy = False;
+   }
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Waits for s, seeing to whatever else finishes in
+   the meantime.  A short write is sent off again for
+   the rest, so a slot that is not busy is done with.
+--*/
+static
+void slotWait ( ioSlot* s )
+{
+   struct io_uring_cqe* c;
+   ioSlot* t;
+   UInt32  head;
+   Int32   res;
+
+   while (s->busy) {
+      head = *uring.cqHead;
+      if (head == __atomic_load_n ( uring.cqTail, __ATOMIC_ACQUIRE )) {
+         if (syscall ( __NR_io_uring_enter, uring.fd, 0, 1,
+                       IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 &&
+             errno != EINTR) ioError();
+         continue;
+      }
+      c   = &uring.cqes[head & *uring.cqMask];
+      t   = (ioSlot*)(size_t)c->user_data;
+      res = c->res;
+      __atomic_store_n ( uring.cqHead, head + 1, __ATOMIC_RELEASE );
+
+      /*-- cancellations come back untagged --*/
+      if (t == NULL) continue;
+
+      if (res < 0) {
+         t->err  = -res;
+         t->busy = False;
+      } else
+      if (t->write && (UInt32)res < t->left) {
+         if (res == 0) { t->err = EIO; t->busy = False; continue; }
+         t->p    += res;
+         t->left -= (UInt32)res;
+         if (t->off != -1) t->off += res;
+         slotSubmit ( t );
+      } else {
+         t->n    = (UInt32)res;
+         t->busy = False;
+      }
+   }
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Chunk i of a file goes through slot i % BZ_IO_SLOTS,
+   with up to depth of them with the kernel at once.
+   That is only more than one for writes to a file we
+   can give an offset for; reads, which are only ever
+   of a pipe or the like, and writes to one, go one
+   chunk ahead of the codec.
+--*/
+typedef
+   struct {
+      UChar*  buf[BZ_IO_SLOTS];
+      ioSlot  slot[BZ_IO_SLOTS];
+      UInt32  put;
+      UInt32  got;
+      UInt32  depth;
+      off_t   off;       /*-- where the next write goes, or -1 --*/
+      int     fd;
+      Bool    eof;
+      Bool    failed;
+      int     err;
+   }
+   ioQueue;
+
+static ioQueue* queueSpare[2];
+
+
+/*---------------------------------------------*/
+/*--
+   NULL if there is no ring, or if a thread would do
+   better: a pipe only takes one chunk at a time from
+   the ring, where a thread keeps a whole ring of them
+   in hand.
+--*/
+static
+ioQueue* queueOpen ( FILE* f, Bool write )
+{
+   ioQueue*       q;
+   struct MY_STAT statBuf;
+   Int32          i;
+   int            fl;
+   int            fd  = fileno ( f );
+   off_t          off = -1;
+
+   if (!uringStart ()) return NULL;
+
+   /*-- O_APPEND would put out-of-order writes in the wrong place --*/
+   if (write && fstat ( fd, &statBuf ) == 0 &&
+       MY_S_ISREG(statBuf.st_mode) &&
+       (fl = fcntl ( fd, F_GETFL )) != -1 && !(fl & O_APPEND))
+      off = lseek ( fd, 0, SEEK_CUR );
+#ifdef BZ_PIPE_IO
+   if (off == -1) return NULL;
+#endif
+
+   q = queueSpare[write];
+   queueSpare[write] = NULL;
+   if (q == NULL) {
+      q = myMalloc ( sizeof(ioQueue) );
+      for (i = 0; i < BZ_IO_SLOTS; i++) q->buf[i] = myMalloc ( BZ_IO_CHUNK );
+   }
+   for (i = 0; i < BZ_IO_SLOTS; i++) q->slot[i].busy = False;
+   q->put    = 0;
+   q->got    = 0;
+   q->depth  = off == -1 ? 1 : BZ_IO_SLOTS;
+   q->off    = off;
+   q->fd     = fd;
+   q->eof    = False;
+   q->failed = False;
+   q->err    = 0;
+   return q;
+}
+
+
+/*---------------------------------------------*/
+/*-- Waits for the oldest chunk out; False if it failed. --*/
+static
+Bool queueReap ( ioQueue* q )
+{
+   ioSlot* s = &q->slot[q->got % BZ_IO_SLOTS];
+
+   slotWait ( s );
+   q->got++;
+   if (s->err != 0 && !q->failed) {
+      q->failed = True;
+      q->err    = s->err;
+   }
+   return !q->failed;
+}
+
+
+static
+void queueSend ( ioQueue* q, UInt32 n, Bool write )
+{
+   ioSlot* s = &q->slot[q->put % BZ_IO_SLOTS];
+
+   s->p     = q->buf[q->put % BZ_IO_SLOTS];
+   s->left  = n;
+   s->off   = q->off;
+   s->fd    = q->fd;
+   s->write = write;
+   s->err   = 0;
+   s->n     = 0;
+   if (q->off != -1) q->off += n;
+   q->put++;
+   slotSubmit ( s );
+}
+
+
+/*---------------------------------------------*/
+/*-- The next chunk read, or NULL at the end of the input. --*/
+static
+UChar* queueTake ( ioQueue* q, UInt32* n )
+{
+   UChar*  p = q->buf[q->got % BZ_IO_SLOTS];
+   ioSlot* s = &q->slot[q->got % BZ_IO_SLOTS];
+
+   if (q->eof) return NULL;
+   if (q->put == 0) queueSend ( q, BZ_IO_CHUNK, False );
+
+   if (!queueReap ( q ) || s->n == 0) {
+      q->eof = True;
+      return NULL;
+   }
+   *n = s->n;
+
+   /*-- the chunk before this one is finished with --*/
+   queueSend ( q, BZ_IO_CHUNK, False );
+   return p;
+}
+
+
+/*-- An empty chunk to write into; NULL after a failed write. --*/
+static
+UChar* queueFree ( ioQueue* q )
+{
+   while (q->put - q->got >= q->depth)
+      if (!queueReap ( q )) return NULL;
+   return q->failed ? NULL : q->buf[q->put % BZ_IO_SLOTS];
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Waits for everything still out, calling off a read
+   that may be waiting on a pipe nobody will close.
+   Says whether every read or write went through,
+   leaving errno as the kernel gave it if not.
+--*/
+static
+Bool queueClose ( ioQueue* q, Bool write )
+{
+   ioSlot* s;
+   Bool    ok = !q->failed;
+
+   /*-- what a read brings back now was never asked for --*/
+   while (q->got != q->put) {
+      s = &q->slot[q->got % BZ_IO_SLOTS];
+      if (!write && s->busy)
+         (void)uringSubmit ( IORING_OP_ASYNC_CANCEL, -1,
+                             (UChar*)s, 0, 0, NULL );
+      (void)queueReap ( q );
+   }
+
+   if (write) {
+      /*-- leave the file where stdio would have --*/
+      if (q->off != -1 && lseek ( q->fd, q->off, SEEK_SET ) == -1 &&
+          !q->failed) {
+         q->failed = True;
+         q->err    = errno;
+      }
+      ok = !q->failed;
+   }
+   if (!ok) errno = q->err;
+
+   if (queueSpare[write] == NULL) {
+      queueSpare[write] = q;
+   } else {
+      Int32 i;
+      for (i = 0; i < BZ_IO_SLOTS; i++) free ( q->buf[i] );
+      free ( q );
+   }
+   return ok;
+}
+
+#endif /* BZ_URING */
+
+
+/*---------------------------------------------*/
+/*--
+   The input side: a regular file is mapped, so the
+   library reads it in place, and the kernel is asked
+   to start on each chunk a few chunks before it is
+   wanted; anything else is read through io_uring,
+   or else by a thread.
+--*/
+typedef
+   struct {
+      UChar*   map;
+      size_t   nMap;
+      size_t   pos;
+      UChar*   base;     /*-- start of the chunk last handed out --*/
+      Bool     end;      /*-- and there are no more --*/
+#ifdef BZ_URING
+      ioQueue* uq;
+#endif
+#ifdef BZ_PIPE_IO
+      ioRing*  rd;
+#endif
+   }
+   inSource;
+
+
+#ifdef BZ_MMAP
+/*--
+   A file which shrinks while mapped raises SIGBUS on the
+   pages past its new end.  While input is mapped, that is
+   reported as the I/O error it is, rather than as the
+   crash mySIGSEGVorSIGBUScatcher takes it for.
+--*/
+static UChar* volatile  busMap;
+static volatile size_t  busLen;
+static struct sigaction busWas;
+
+
+/*---------------------------------------------*/
+static
+void mappedInputBus ( IntNative n, siginfo_t* info, void* ctx )
+{
+   UChar* a = (UChar*)info->si_addr;
+
+   (void)ctx;
+   if (busMap != NULL && a >= busMap && a < busMap + busLen) {
+      busMap = NULL;
+      errno  = EIO;
+      ioError ();
+   }
+   mySIGSEGVorSIGBUScatcher ( n );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Maps what is left of f, if f is a regular file.
+   The data starts *skip bytes into the *nMap mapped;
+   NULL means f has to be read.
+--*/
+static
+UChar* mapInput ( FILE* f, size_t* nMap, size_t* skip )
+{
+   struct MY_STAT statBuf;
+   off_t          here;
+   void*          map;
+   IntNative      fd = fileno ( f );
+
+   if (fd < 0 || fstat ( fd, &statBuf ) != 0 ||
+       !MY_S_ISREG(statBuf.st_mode)) return NULL;
+   here = lseek ( fd, 0, SEEK_CUR );
+   if (here < 0 || here >= statBuf.st_size ||
+       (off_t)(size_t)statBuf.st_size != statBuf.st_size) return NULL;
+
+   map = mmap ( NULL, (size_t)statBuf.st_size, PROT_READ, MAP_PRIVATE,
+                fd, 0 );
+   if (map == MAP_FAILED) return NULL;
+#  ifdef MADV_SEQUENTIAL
+   (void)madvise ( map, (size_t)statBuf.st_size, MADV_SEQUENTIAL );
+#  endif
+
+   {
+      struct sigaction sa;
+
+      busMap = (UChar*)map;
+      busLen = (size_t)statBuf.st_size;
+      memset ( &sa, 0, sizeof(sa) );
+      sa.sa_sigaction = mappedInputBus;
+      sa.sa_flags     = SA_SIGINFO;
+      sigemptyset ( &sa.sa_mask );
+      sigaction ( SIGBUS, &sa, &busWas );
+   }
+
+   *nMap = (size_t)statBuf.st_size;
+   *skip = (size_t)here;
+   return (UChar*)map;
+}
+#endif
+
+
+/*---------------------------------------------*/
+/*-- False if f can only be read through stdio here. --*/
+static
+Bool inOpen ( inSource* in, FILE* f )
+{
+   in->map  = NULL;
+   in->base = NULL;
+   in->end  = False;
+#ifdef BZ_URING
+   in->uq   = NULL;
+#endif
+#ifdef BZ_MMAP
+   in->map = mapInput ( f, &in->nMap, &in->pos );
+   if (in->map != NULL) return True;
+#endif
+#ifdef BZ_URING
+   in->uq = queueOpen ( f, False );
+   if (in->uq != NULL) return True;
+#endif
+#ifdef BZ_PIPE_IO
+   in->rd = ringOpen ( f, readerThread, False );
+   if (in->rd != NULL) return True;
+#endif
+   return False;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Points strm at the next stretch of input, which
+   invalidates the one before; False at the end.
+--*/
+static
+Bool inNext ( inSource* in, bz_stream* strm )
+{
+   UChar* p = NULL;
+   UInt32 n = 0;
+
+   if (in->map != NULL) {
+      if (in->pos < in->nMap) {
+         p = in->map + in->pos;
+         n = in->nMap - in->pos > BZ_IO_CHUNK
+                ? BZ_IO_CHUNK : (UInt32)(in->nMap - in->pos);
+         in->pos += n;
+#        if defined(BZ_MMAP) && defined(MADV_WILLNEED)
+         {
+            size_t ahead = (in->pos / BZ_IO_CHUNK + BZ_IO_SLOTS)
+                           * BZ_IO_CHUNK;
+            if (ahead < in->nMap)
+               (void)madvise ( in->map + ahead,
+                               in->nMap - ahead > BZ_IO_CHUNK
+                                  ? BZ_IO_CHUNK : in->nMap - ahead,
+                               MADV_WILLNEED );
+         }
+#        endif
+      }
+   }
+#ifdef BZ_URING
+   else if (in->uq != NULL) p = queueTake ( in->uq, &n );
+#endif
+#ifdef BZ_PIPE_IO
+   else {
+      if (in->base != NULL) ringGot ( in->rd );
+      p = ringTake ( in->rd, &n );
+   }
+#endif
+
+   in->base = p;
+   if (p == NULL) { in->end = True; return False; }
+   strm->next_in  = (char*)p;
+   strm->avail_in = n;
+   return True;
+}
+
+
+/*---------------------------------------------*/
+/*-- False if reading the input failed. --*/
+static
+Bool inClose ( inSource* in )
+{
+#ifdef BZ_MMAP
+   if (in->map != NULL) {
+      sigaction ( SIGBUS, &busWas, NULL );
+      busMap = NULL;
+      munmap ( in->map, in->nMap );
+      return True;
+   }
+#endif
+#ifdef BZ_URING
+   if (in->uq != NULL) return queueClose ( in->uq, False );
+#endif
+#ifdef BZ_PIPE_IO
+   return ringClose ( in->rd, True );
+#else
+   return True;
+#endif
+}
+
+
+/*---------------------------------------------*/
+/*--
+   The output side: chunks for io_uring or a writer
+   thread, or else one buffer written out from here.
+   A NULL f throws the output away, for -t.
+--*/
+typedef
+   struct {
+      FILE*    f;
+      UChar*   buf;
+#ifdef BZ_URING
+      ioQueue* uq;
+#endif
+#ifdef BZ_PIPE_IO
+      ioRing*  wr;
+#endif
+   }
+   outSink;
+
+
+static
+void outOpen ( outSink* out, FILE* f )
+{
+   out->f   = f;
+   out->buf = NULL;
+#ifdef BZ_URING
+   out->uq  = NULL;
+#endif
+#ifdef BZ_PIPE_IO
+   out->wr  = NULL;
+#endif
+#ifdef BZ_URING
+   if (f != NULL) out->uq = queueOpen ( f, True );
+   if (out->uq != NULL) return;
+#endif
+#ifdef BZ_PIPE_IO
+   if (f != NULL) out->wr = ringOpen ( f, writerThread, spliceMode );
+   if (out->wr != NULL) return;
+#endif
+   out->buf = myMalloc ( BZ_IO_CHUNK );
+}
+
+
+/*---------------------------------------------*/
+/*-- Points strm at an empty chunk; False after a write error. --*/
+static
+Bool outNext ( outSink* out, bz_stream* strm )
+{
+   UChar* p = out->buf;
+
+#ifdef BZ_URING
+   if (out->uq != NULL) {
+      p = queueFree ( out->uq );
+      if (p == NULL) return False;
+   }
+#endif
+#ifdef BZ_PIPE_IO
+   if (out->wr != NULL) {
+      p = ringFree ( out->wr );
+      if (p == NULL) return False;
+   }
+#endif
+   strm->next_out  = (char*)p;
+   strm->avail_out = BZ_IO_CHUNK;
+   return True;
+}
+
+
+/*-- Passes on the first n bytes of the chunk outNext gave. --*/
 static
-Int32 uInt64_qrm10 ( UInt64* n )
+Bool outPut ( outSink* out, UInt32 n )
 {
-   UInt32 rem, tmp;
-   Int32  i;
-   rem = 0;
-   for (i = 7; i >= 0; i--) {
-      tmp = rem * 256 + n->b[i];
-      n->b[i] = tmp / 10;
-      rem = tmp % 10;
+#ifdef BZ_URING
+   if (out->uq != NULL) {
+      if (n > 0) queueSend ( out->uq, n, True );
+      return True;
    }
-   return rem;
+#endif
+#ifdef BZ_PIPE_IO
+   if (out->wr != NULL) {
+      ringPut ( out->wr, n );
+      return True;
+   }
+#endif
+   if (out->f == NULL || n == 0) return True;
+   return fwrite ( out->buf, sizeof(UChar), n, out->f ) == n &&
+          !ferror(out->f);
 }
 
 
-/* ... and the Whole Entire Point of all this UInt64 stuff is
-   so that we can supply the following function.
-*/
+/*-- False if any write failed. --*/
 static
-void uInt64_toAscii ( char* outbuf, UInt64* n )
+Bool outClose ( outSink* out )
 {
-   Int32  i, q;
-   UChar  buf[32];
-   Int32  nBuf   = 0;
-   UInt64 n_copy = *n;
-   do {
-      q = uInt64_qrm10 ( &n_copy );
-      buf[nBuf] = q + '0';
-      nBuf++;
-   } while (!uInt64_isZero(&n_copy));
-   outbuf[nBuf] = 0;
-   for (i = 0; i < nBuf; i++)
-      outbuf[i] = buf[nBuf-i-1];
+#ifdef BZ_URING
+   if (out->uq != NULL) return queueClose ( out->uq, True );
+#endif
+#ifdef BZ_PIPE_IO
+   if (out->wr != NULL) return ringClose ( out->wr, False );
+#endif
+   free ( out->buf );
+   return True;
 }
 
 
-/*---------------------------------------------------*/
-/*--- Processing of complete files and streams    ---*/
-/*---------------------------------------------------*/
+/*---------------------------------------------*/
+/*--
+   The BZ2_bzWrite loop of compressStream.  Returns
+   BZ_OK, with the totals BZ2_bzWriteClose64 would
+   have given, or the error it would have reported.
+--*/
+static
+Int32 compressDirect ( inSource* in, FILE* zStream,
+                       UInt32* nbytes_in_lo32, UInt32* nbytes_in_hi32,
+                       UInt32* nbytes_out_lo32, UInt32* nbytes_out_hi32 )
+{
+   bz_stream strm;
+   outSink   out;
+   Int32     ret, action;
+
+   strm.bzalloc = NULL;
+   strm.bzfree  = NULL;
+   strm.opaque  = NULL;
+   ret = BZ2_bzCompressInitMT ( &strm, blockSize100k, verbosity,
+                                workFactor, numThreads );
+   if (ret != BZ_OK) return ret;
+
+   outOpen ( &out, zStream );
+   strm.avail_in = 0;
+   action = BZ_RUN;
+   ret = outNext ( &out, &strm ) ? BZ_RUN_OK : BZ_IO_ERROR;
+
+   while (ret == BZ_RUN_OK || ret == BZ_FINISH_OK) {
+      if (action == BZ_RUN && strm.avail_in == 0 && !inNext ( in, &strm ))
+         action = BZ_FINISH;
+      ret = BZ2_bzCompress ( &strm, action );
+      if ((ret == BZ_RUN_OK || ret == BZ_FINISH_OK) &&
+          strm.avail_out == 0 &&
+          !(outPut ( &out, BZ_IO_CHUNK ) && outNext ( &out, &strm )))
+         ret = BZ_IO_ERROR;
+   }
+
+   if (ret == BZ_STREAM_END) {
+      ret = outPut ( &out, BZ_IO_CHUNK - strm.avail_out )
+               ? BZ_OK : BZ_IO_ERROR;
+      *nbytes_in_lo32  = strm.total_in_lo32;
+      *nbytes_in_hi32  = strm.total_in_hi32;
+      *nbytes_out_lo32 = strm.total_out_lo32;
+      *nbytes_out_hi32 = strm.total_out_hi32;
+   }
+   BZ2_bzCompressEnd ( &strm );
+   if (!outClose ( &out ) && ret == BZ_OK) ret = BZ_IO_ERROR;
+   return ret;
+}
+
 
 /*---------------------------------------------*/
+/*--
+   The BZ2_bzRead loops of uncompressStream and
+   testStream.  Returns BZ_STREAM_END once every
+   stream has ended with the input, or else what
+   BZ2_bzRead would have reported; BZ_DATA_ERROR_MAGIC
+   with *streamNo > 1 is trailing garbage.  With
+   copyOnMagic, a stream with a bad magic number and
+   all that follows it are copied out as they are,
+   which stands in for rewinding input we cannot.
+--*/
 static
-Bool myfeof ( FILE* f )
+Int32 uncompressDirect ( inSource* in, FILE* stream, Int32* streamNo,
+                         Bool copyOnMagic )
 {
-   Int32 c = fgetc ( f );
-   if (c == EOF) return True;
-   ungetc ( c, f );
-   return False;
+   bz_stream strm;
+   outSink   out;
+   char*     next_in  = NULL;
+   UInt32    avail_in = 0;
+   UInt32    nFed;
+   UInt32    back     = 0;
+   Int32     ret;
+
+   outOpen ( &out, stream );
+   ret = outNext ( &out, &strm ) ? BZ_OK : BZ_IO_ERROR;
+
+   while (ret == BZ_OK) {
+
+      strm.bzalloc = NULL;
+      strm.bzfree  = NULL;
+      strm.opaque  = NULL;
+      ret = BZ2_bzDecompressInitMT (
+               &strm, verbosity,
+               smallMode ? 1 : wideMode ? BZ_SMALL_WIDE : 0,
+               numThreads
+            );
+      if (ret != BZ_OK) break;
+      (*streamNo)++;
+      strm.next_in  = next_in;
+      strm.avail_in = avail_in;
+
+      do {
+         if (strm.avail_in == 0 && !in->end) (void)inNext ( in, &strm );
+         nFed = strm.avail_in;
+         ret  = BZ2_bzDecompress ( &strm );
+
+         /*-- as in BZ2_bzRead: only a call with nothing new
+              to read, which made no room, shows a short file --*/
+         if (ret == BZ_OK && in->end && nFed == 0 &&
+             strm.avail_in == 0 && strm.avail_out > 0)
+            ret = BZ_UNEXPECTED_EOF;
+
+         if ((ret == BZ_OK || ret == BZ_STREAM_END) &&
+             strm.avail_out == 0 &&
+             !(outPut ( &out, BZ_IO_CHUNK ) && outNext ( &out, &strm )))
+            ret = BZ_IO_ERROR;
+      } while (ret == BZ_OK);
+
+      next_in  = strm.next_in;
+      avail_in = strm.avail_in;
+      back     = strm.total_in_lo32;
+      (void)BZ2_bzDecompressEnd ( &strm );
+
+      if (ret == BZ_STREAM_END) {
+         if (avail_in == 0) {
+            if (in->end || !inNext ( in, &strm )) break;
+            next_in  = strm.next_in;
+            avail_in = strm.avail_in;
+         }
+         ret = BZ_OK;
+      }
+   }
+
+   /*-- what was decoded before an error goes out too,
+        as it would have through BZ2_bzRead --*/
+   if (ret != BZ_IO_ERROR &&
+       !outPut ( &out, BZ_IO_CHUNK - strm.avail_out ))
+      ret = BZ_IO_ERROR;
+   if (!outClose ( &out ) &&
+       (ret == BZ_STREAM_END || ret == BZ_DATA_ERROR_MAGIC))
+      ret = BZ_IO_ERROR;
+
+   if (ret == BZ_DATA_ERROR_MAGIC && copyOnMagic) {
+      /*-- the magic number is checked as it is read, so
+           what was taken of it is still in this chunk,
+           unless it straddled the last --*/
+      if (back > (UInt32)((UChar*)next_in - in->base))
+         back = (UInt32)((UChar*)next_in - in->base);
+      next_in  -= back;
+      avail_in += back;
+      ret = BZ_STREAM_END;
+      while (True) {
+         if (fwrite ( next_in, sizeof(UChar), avail_in, stream )
+                != avail_in || ferror(stream))
+            { ret = BZ_IO_ERROR; break; }
+         if (!inNext ( in, &strm )) break;
+         next_in  = strm.next_in;
+         avail_in = strm.avail_in;
+      }
+   }
+
+   return ret;
 }
 
+#endif /* BZ_DIRECT_IO */
+
 
 /*---------------------------------------------*/
 static
@@ -320,6 +1555,9 @@ void compressStream ( FILE *stream, FILE *zStream )
    UInt32  nbytes_in_lo32, nbytes_in_hi32;
    UInt32  nbytes_out_lo32, nbytes_out_hi32;
    Int32   bzerr, bzerr_dummy, ret;
+#ifdef BZ_DIRECT_IO
+   inSource in;
+#endif
 
    SET_BINARY_MODE(stream);
    SET_BINARY_MODE(zStream);
@@ -327,27 +1565,39 @@ void compressStream ( FILE *stream, FILE *zStream )
    if (ferror(stream)) goto errhandler_io;
    if (ferror(zStream)) goto errhandler_io;
 
-   bzf = BZ2_bzWriteOpen ( &bzerr, zStream,
-                           blockSize100k, verbosity, workFactor );
-   if (bzerr != BZ_OK) goto errhandler;
+#ifdef BZ_DIRECT_IO
+   if (inOpen ( &in, stream )) {
+      if (verbosity >= 2) fprintf ( stderr, "\n" );
+      bzerr = compressDirect ( &in, zStream,
+                               &nbytes_in_lo32, &nbytes_in_hi32,
+                               &nbytes_out_lo32, &nbytes_out_hi32 );
+      if (!inClose ( &in ) && bzerr == BZ_OK) bzerr = BZ_IO_ERROR;
+      if (bzerr != BZ_OK) goto errhandler;
+   } else
+#endif
+   {
+      bzf = BZ2_bzWriteOpenMT ( &bzerr, zStream, blockSize100k,
+                                verbosity, workFactor, numThreads );
+      if (bzerr != BZ_OK) goto errhandler;
+
+      if (verbosity >= 2) fprintf ( stderr, "\n" );
 
-   if (verbosity >= 2) fprintf ( stderr, "\n" );
+      while (True) {
 
-   while (True) {
+         if (myfeof(stream)) break;
+         nIbuf = fread ( ibuf, sizeof(UChar), 5000, stream );
+         if (ferror(stream)) goto errhandler_io;
+         if (nIbuf > 0) BZ2_bzWrite ( &bzerr, bzf, (void*)ibuf, nIbuf );
+         if (bzerr != BZ_OK) goto errhandler;
 
-      if (myfeof(stream)) break;
-      nIbuf = fread ( ibuf, sizeof(UChar), 5000, stream );
-      if (ferror(stream)) goto errhandler_io;
-      if (nIbuf > 0) BZ2_bzWrite ( &bzerr, bzf, (void*)ibuf, nIbuf );
-      if (bzerr != BZ_OK) goto errhandler;
+      }
 
+      BZ2_bzWriteClose64 ( &bzerr, bzf, 0,
+                           &nbytes_in_lo32, &nbytes_in_hi32,
+                           &nbytes_out_lo32, &nbytes_out_hi32 );
+      if (bzerr != BZ_OK) goto errhandler;
    }
 
-   BZ2_bzWriteClose64 ( &bzerr, bzf, 0,
-                        &nbytes_in_lo32, &nbytes_in_hi32,
-                        &nbytes_out_lo32, &nbytes_out_hi32 );
-   if (bzerr != BZ_OK) goto errhandler;
-
    if (ferror(zStream)) goto errhandler_io;
    ret = fflush ( zStream );
    if (ret == EOF) goto errhandler_io;
@@ -425,6 +1675,9 @@ Bool uncompressStream ( FILE *zStream, FILE *stream )
    Int32   nUnused;
    void*   unusedTmpV;
    UChar*  unusedTmp;
+#ifdef BZ_DIRECT_IO
+   inSource in;
+#endif
 
    nUnused = 0;
    streamNo = 0;
@@ -435,11 +1688,24 @@ Bool uncompressStream ( FILE *zStream, FILE *stream )
    if (ferror(stream)) goto errhandler_io;
    if (ferror(zStream)) goto errhandler_io;
 
+#ifdef BZ_DIRECT_IO
+   if (inOpen ( &in, zStream )) {
+      bzerr = uncompressDirect ( &in, stream, &streamNo,
+                                 forceOverwrite && in.map == NULL );
+      if (!inClose ( &in ) && bzerr == BZ_STREAM_END) bzerr = BZ_IO_ERROR;
+      if (bzerr == BZ_STREAM_END) goto closeok;
+      if (bzerr == BZ_DATA_ERROR_MAGIC) goto trycat;
+      goto errhandler;
+   }
+#endif
+
    while (True) {
 
-      bzf = BZ2_bzReadOpen (
+      bzf = BZ2_bzReadOpenMT (
                &bzerr, zStream, verbosity,
-               (int)smallMode, unused, nUnused
+               smallMode ? 1 : wideMode ? BZ_SMALL_WIDE : 0,
+               unused, nUnused,
+               numThreads
             );
       if (bzf == NULL || bzerr != BZ_OK) goto errhandler;
       streamNo++;
@@ -546,6 +1812,9 @@ Bool testStream ( FILE *zStream )
    Int32   nUnused;
    void*   unusedTmpV;
    UChar*  unusedTmp;
+#ifdef BZ_DIRECT_IO
+   inSource in;
+#endif
 
    nUnused = 0;
    streamNo = 0;
@@ -553,11 +1822,20 @@ Bool testStream ( FILE *zStream )
    SET_BINARY_MODE(zStream);
    if (ferror(zStream)) goto errhandler_io;
 
+#ifdef BZ_DIRECT_IO
+   if (inOpen ( &in, zStream )) {
+      bzerr = uncompressDirect ( &in, NULL, &streamNo, False );
+      if (!inClose ( &in ) && bzerr == BZ_STREAM_END) bzerr = BZ_IO_ERROR;
+      if (bzerr != BZ_STREAM_END) goto errhandler;
+   } else
+#endif
    while (True) {
 
-      bzf = BZ2_bzReadOpen (
+      bzf = BZ2_bzReadOpenMT (
                &bzerr, zStream, verbosity,
-               (int)smallMode, unused, nUnused
+               smallMode ? 1 : wideMode ? BZ_SMALL_WIDE : 0,
+               unused, nUnused,
+               numThreads
             );
       if (bzf == NULL || bzerr != BZ_OK) goto errhandler;
       streamNo++;
@@ -675,6 +1953,10 @@ void cleanUpAndFail ( Int32 ec )
    IntNative      retVal;
    struct MY_STAT statBuf;
 
+#  ifdef BZ_BATCH
+   stopJobs ( SIGTERM );
+#  endif
+
    if ( srcMode == SM_F2F
         && opMode != OM_TEST
         && deleteOutputOnInterrupt ) {
@@ -793,6 +2075,11 @@ void mySignalCatcher ( IntNative n )
    fprintf ( stderr,
              "\n%s: Control-C or similar caught, quitting.\n",
              progName );
+#  ifdef BZ_BATCH
+   stopJobs ( n );
+#  else
+   (void)n;
+#  endif
    cleanUpAndFail(1);
 }
 
@@ -802,6 +2089,7 @@ static
 void mySIGSEGVorSIGBUScatcher ( IntNative n )
 {
    const char *msg;
+   (void)n;
    if (opMode == OM_Z)
       msg = ": Caught a SIGSEGV or SIGBUS whilst compressing.\n"
       "\n"
@@ -1080,6 +2368,7 @@ Bool containsDubiousChars ( Char* name )
    /* On unix, files can contain any characters and the file expansion
     * is performed by the shell.
     */
+   (void)name;
    return False;
 #  else /* ! BZ_UNIX */
    /* On non-unix (Win* platforms), wildcard characters are not allowed in
@@ -1632,14 +2921,19 @@ void usage ( Char *fullProgName )
       "   -f --force          overwrite existing output files\n"
       "   -t --test           test compressed file integrity\n"
       "   -c --stdout         output to standard out\n"
+      "   -r --recursive      go into directories; several files at once\n"
       "   -q --quiet          suppress noncritical error messages\n"
       "   -v --verbose        be verbose (a 2nd -v gives more)\n"
       "   -L --license        display software version & license\n"
       "   -V --version        display software version & license\n"
       "   -s --small          use less memory (at most 2500k)\n"
       "   -1 .. -9            set block size to 100k .. 900k\n"
+      "   -T<n> --threads=<n> use n threads; 0 means one per CPU (default)\n"
       "   --fast              alias for -1\n"
       "   --best              alias for -9\n"
+      "   --linear-sort       sort blocks in linear time (more memory)\n"
+      "   --wide-table        decompress two bytes per lookup (more memory)\n"
+      "   --vmsplice          hand output pages to a pipe instead of copying\n"
       "\n"
       "   If invoked as `bzip2', default action is to compress.\n"
       "              as `bunzip2',  default action is to decompress.\n"
@@ -1659,6 +2953,44 @@ void usage ( Char *fullProgName )
 }
 
 
+/*---------------------------------------------*/
+static
+Int32 onlineCPUs ( void )
+{
+#  if BZ_UNIX && defined(_SC_NPROCESSORS_ONLN)
+   long n = sysconf ( _SC_NPROCESSORS_ONLN );
+   if (n < 1) return 1;
+   if (n > BZ_MAX_THREADS) return BZ_MAX_THREADS;
+   return (Int32)n;
+#  else
+   return 1;
+#  endif
+}
+
+
+/*---------------------------------------------*/
+static
+void threadsFlag ( Char* flag, Char* count )
+{
+   Int32 n = 0;
+
+   if (*count == '\0') n = -1;
+   for (; *count != '\0' && n >= 0; count++) {
+      if (!isdigit((UChar)*count)) n = -1; else
+         n = 10 * n + (*count - '0');
+      if (n > BZ_MAX_THREADS) n = -1;
+   }
+   if (n < 0) {
+      fprintf ( stderr,
+                "%s: Bad flag `%s'; thread count must be 0 .. %d\n",
+                progName, flag, BZ_MAX_THREADS );
+      usage ( progName );
+      exit ( 1 );
+   }
+   numThreads = (n == 0) ? onlineCPUs() : n;
+}
+
+
 /*---------------------------------------------*/
 static
 void redundant ( Char* flag )
@@ -1764,6 +3096,402 @@ void addFlagsFromEnvVar ( Cell** argList, Char* varName )
 }
 
 
+/*---------------------------------------------------*/
+/*--- Recursive batches                           ---*/
+/*---------------------------------------------------*/
+
+#ifdef BZ_BATCH
+
+/*--
+   -r turns directories on the command line into the
+   files below them, then hands each file to a child
+   process of its own, several at a time.  A child runs
+   compress(), uncompress() or testf() exactly as a one-file
+   command line would, so every check those make still
+   applies; what it says on stderr comes back through a
+   pipe and is printed in list order, and its exit value
+   counts as that file's.  Processes rather than threads,
+   since the per-file state above is all globals.
+--*/
+typedef
+   struct {
+      Char*     name;
+      pid_t     pid;
+      IntNative fd;       /*-- its stderr, -1 once at EOF --*/
+      Char*     msg;      /*-- held back until it is the head --*/
+      Int32     nMsg;
+      Int32     szMsg;
+      Int32     status;   /*-- exit value, or -signal --*/
+   }
+   Job;
+
+static Job*  job;
+static Int32 nJobs;
+static Int32 jobHead;     /*-- first not yet printed --*/
+static Int32 jobNext;     /*-- first not yet started --*/
+
+
+/*---------------------------------------------*/
+static
+Bool wantedInTree ( Char* name )
+{
+   Int32 i;
+
+   for (i = 0; i < BZ_N_SUFFIX_PAIRS; i++)
+      if (hasSuffix ( name, zSuffix[i] )) return opMode != OM_Z;
+   return opMode == OM_Z;
+}
+
+
+/*---------------------------------------------*/
+static
+IntNative cmpNames ( const void* a, const void* b )
+{
+   return strcmp ( *(Char* const*)a, *(Char* const*)b );
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Appends name to the list ending at *tail or, if it is a
+   directory, the files below it in sorted order.  Below
+   the top, symbolic links are not followed, and only
+   regular files the operation would pick by their suffix
+   are taken, so bzip2 -r does not complain about every
+   .bz2 file it passes over.
+--*/
+static
+void addTree ( Cell*** tail, Char* name, Bool top )
+{
+   struct MY_STAT statBuf;
+   struct dirent* e;
+   DIR*           d;
+   Char**         ent;
+   Char**         more;
+   Char*          path;
+   Int32          n, sz, i, len;
+   IntNative      r;
+
+   r = top ? MY_STAT ( name, &statBuf ) : MY_LSTAT ( name, &statBuf );
+   if (r != 0 || !MY_S_ISDIR(statBuf.st_mode)) {
+      if (top || (r == 0 && MY_S_ISREG(statBuf.st_mode)
+                         && wantedInTree ( name ))) {
+         **tail = mkCell();
+         (**tail)->name = (Char*) myMalloc ( (Int32)strlen(name) + 1 );
+         strcpy ( (**tail)->name, name );
+         *tail = &(**tail)->link;
+      }
+      return;
+   }
+
+   d = opendir ( name );
+   if (d == NULL) {
+      fprintf ( stderr, "%s: Can't open directory %s: %s.\n",
+                progName, name, strerror(errno) );
+      setExit(1);
+      return;
+   }
+
+   /*-- Closed before going down, so depth costs no descriptors. --*/
+   n = sz = 0;
+   ent = NULL;
+   while ((e = readdir ( d )) != NULL) {
+      if (strcmp ( e->d_name, "." ) == 0 ||
+          strcmp ( e->d_name, ".." ) == 0) continue;
+      if (n == sz) {
+         sz = 2 * sz + 16;
+         more = (Char**) myMalloc ( sz * (Int32)sizeof(Char*) );
+         if (n > 0) memcpy ( more, ent, n * sizeof(Char*) );
+         free ( ent );
+         ent = more;
+      }
+      ent[n] = (Char*) myMalloc ( (Int32)strlen(e->d_name) + 1 );
+      strcpy ( ent[n++], e->d_name );
+   }
+   closedir ( d );
+   if (n > 1) qsort ( ent, n, sizeof(Char*), cmpNames );
+
+   len = (Int32)strlen(name);
+   for (i = 0; i < n; i++) {
+      path = (Char*) myMalloc ( len + (Int32)strlen(ent[i]) + 2 );
+      strcpy ( path, name );
+      if (name[len-1] != '/') strcat ( path, "/" );
+      strcat ( path, ent[i] );
+      addTree ( tail, path, False );
+      free ( path );
+      free ( ent[i] );
+   }
+   free ( ent );
+}
+
+
+/*---------------------------------------------*/
+static
+void jobSays ( Job* j, Char* buf, Int32 n )
+{
+   Char* more;
+
+   if (j == &job[jobHead]) {
+      fwrite ( buf, 1, n, stderr );
+      return;
+   }
+   if (j->nMsg + n > j->szMsg) {
+      j->szMsg = 2 * (j->nMsg + n);
+      more = (Char*) myMalloc ( j->szMsg );
+      if (j->nMsg > 0) memcpy ( more, j->msg, j->nMsg );
+      free ( j->msg );
+      j->msg = more;
+   }
+   memcpy ( j->msg + j->nMsg, buf, n );
+   j->nMsg += n;
+}
+
+
+/*---------------------------------------------*/
+static
+void startJob ( Int32 k, Int32 threads )
+{
+   Char*     name = job[k].name;
+   IntNative p[2];
+   pid_t     pid;
+   Int32     i;
+
+   if (pipe ( p ) != 0) ioError ();
+   fflush ( stdout );
+   fflush ( stderr );
+   pid = fork ();
+   if (pid < 0) ioError ();
+
+   if (pid == 0) {
+      close ( p[0] );
+      for (i = jobHead; i < k; i++) {
+         if (job[i].fd >= 0) close ( job[i].fd );
+         free ( job[i].msg );
+      }
+      if (p[1] != 2) {
+         dup2 ( p[1], 2 );
+         close ( p[1] );
+      }
+
+      /*-- A one-file run from here on. --*/
+      free ( job );
+      job               = NULL;
+      numThreads        = threads;
+      numFileNames      = 1;
+      numFilesProcessed = 1;
+      switch (opMode) {
+         case OM_Z:   compress ( name ); break;
+         case OM_UNZ: uncompress ( name ); break;
+         default:     testf ( name ); break;
+      }
+      if (testFailsExist || unzFailsExist) setExit(2);
+      exit ( exitValue );
+   }
+
+   close ( p[1] );
+   job[k].pid = pid;
+   job[k].fd  = p[0];
+}
+
+
+/*---------------------------------------------*/
+static
+void reapJob ( Job* j )
+{
+   IntNative st;
+
+   close ( j->fd );
+   j->fd = -1;
+   while (waitpid ( j->pid, &st, 0 ) < 0) {
+      if (errno != EINTR) { st = 0; break; }
+   }
+   if (WIFSIGNALED(st))
+      j->status = -(Int32)WTERMSIG(st); else
+      j->status = WEXITSTATUS(st);
+}
+
+
+/*---------------------------------------------*/
+static
+void finishJob ( Job* j )
+{
+   if (j->status < 0) {
+      fprintf ( stderr, "%s: %s: killed by signal %d.\n",
+                progName, j->name, -j->status );
+      setExit(1);
+   } else {
+      setExit(j->status);
+      if (j->status == 2 && opMode == OM_TEST) testFailsExist = True;
+      if (j->status == 2 && opMode == OM_UNZ)  unzFailsExist  = True;
+   }
+   free ( j->msg );
+   j->msg = NULL;
+   numFilesProcessed++;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   For a signal or a fatal error in the parent: passes
+   sig on to the children still running, so each cleans
+   up after its own file, and waits for them, printing
+   whatever they have to say.
+--*/
+static
+void stopJobs ( IntNative sig )
+{
+   Job*  jobs = job;
+   Char  buf[4096];
+   Int32 i, n;
+
+   if (jobs == NULL) return;
+   job = NULL;
+
+   for (i = jobHead; i < jobNext; i++)
+      if (jobs[i].fd >= 0) kill ( jobs[i].pid, sig );
+
+   for (i = jobHead; i < jobNext; i++) {
+      if (jobs[i].nMsg > 0)
+         fwrite ( jobs[i].msg, 1, jobs[i].nMsg, stderr );
+      if (jobs[i].fd < 0) continue;
+      while ((n = read ( jobs[i].fd, buf, sizeof(buf) )) != 0) {
+         if (n > 0) fwrite ( buf, 1, n, stderr ); else
+         if (errno != EINTR) break;
+      }
+      close ( jobs[i].fd );
+      waitpid ( jobs[i].pid, NULL, 0 );
+   }
+   numFilesProcessed = jobNext;
+}
+
+
+/*---------------------------------------------*/
+/*--
+   Runs the files in the list, up to numThreads at a time,
+   with the threads shared out between them.  Writing to
+   stdout, they go one at a time so output stays in order.
+--*/
+static
+void runJobs ( Cell* files )
+{
+   struct pollfd* pfd;
+   Int32*         who;
+   Char           buf[4096];
+   Int32          workers, threads, running, nfd, i, n;
+   Cell*          c;
+
+   nJobs = 0;
+   for (c = files; c != NULL; c = c->link) nJobs++;
+   if (nJobs == 0) return;
+
+   job = (Job*) myMalloc ( nJobs * (Int32)sizeof(Job) );
+   for (c = files, i = 0; c != NULL; c = c->link, i++) {
+      job[i].name   = c->name;
+      job[i].pid    = 0;
+      job[i].fd     = -1;
+      job[i].msg    = NULL;
+      job[i].nMsg   = 0;
+      job[i].szMsg  = 0;
+      job[i].status = 0;
+   }
+
+   workers = (srcMode == SM_F2O) ? 1 : numThreads;
+   if (workers > nJobs) workers = nJobs;
+   if (workers < 1) workers = 1;
+   threads = numThreads / workers;
+   if (threads < 1) threads = 1;
+
+   pfd = (struct pollfd*) myMalloc ( workers *
+                                     (Int32)sizeof(struct pollfd) );
+   who = (Int32*) myMalloc ( workers * (Int32)sizeof(Int32) );
+   jobHead = jobNext = 0;
+   running = 0;
+
+   while (jobHead < nJobs) {
+      while (running < workers && jobNext < nJobs) {
+         startJob ( jobNext++, threads );
+         running++;
+      }
+
+      nfd = 0;
+      for (i = jobHead; i < jobNext; i++) {
+         if (job[i].fd < 0) continue;
+         pfd[nfd].fd     = job[i].fd;
+         pfd[nfd].events = POLLIN;
+         who[nfd++]      = i;
+      }
+      if (poll ( pfd, nfd, -1 ) < 0) {
+         if (errno == EINTR) continue;
+         ioError ();
+      }
+
+      for (i = 0; i < nfd; i++) {
+         if (pfd[i].revents == 0) continue;
+         n = read ( pfd[i].fd, buf, sizeof(buf) );
+         if (n > 0) {
+            jobSays ( &job[who[i]], buf, n );
+         } else
+         if (n == 0 || errno != EINTR) {
+            reapJob ( &job[who[i]] );
+            running--;
+         }
+      }
+
+      /*-- A job is printed once all before it have been. --*/
+      while (jobHead < jobNext && job[jobHead].fd < 0) {
+         finishJob ( &job[jobHead++] );
+         if (jobHead < jobNext && job[jobHead].nMsg > 0) {
+            fwrite ( job[jobHead].msg, 1, job[jobHead].nMsg, stderr );
+            job[jobHead].nMsg = 0;
+         }
+      }
+   }
+
+   free ( who );
+   free ( pfd );
+   free ( job );
+   job = NULL;
+}
+
+
+/*---------------------------------------------*/
+static
+void runBatch ( Cell* argList )
+{
+   Cell*  files;
+   Cell** tail;
+   Cell*  aa;
+   Bool   decode;
+
+   files  = NULL;
+   tail   = &files;
+   decode = True;
+   for (aa = argList; aa != NULL; aa = aa->link) {
+      if (strcmp ( aa->name, "--" ) == 0) { decode = False; continue; }
+      if (aa->name[0] == '-' && decode) continue;
+      addTree ( &tail, aa->name, True );
+   }
+
+   numFileNames = 0;
+   for (aa = files; aa != NULL; aa = aa->link) {
+      numFileNames++;
+      if (longestFileName < (Int32)strlen(aa->name) )
+         longestFileName = (Int32)strlen(aa->name);
+   }
+
+   runJobs ( files );
+
+   while (files != NULL) {
+      aa = files->link;
+      free ( files->name );
+      free ( files );
+      files = aa;
+   }
+}
+
+#endif
+
+
 /*---------------------------------------------*/
 #define ISFLAG(s) (strcmp(aa->name, (s))==0)
 
@@ -1784,6 +3512,9 @@ IntNative main ( IntNative argc, Char *argv[] )
    /*-- Initialise --*/
    outputHandleJustInCase  = NULL;
    smallMode               = False;
+   wideMode                = False;
+   spliceMode              = False;
+   recursive               = False;
    keepInputFiles          = False;
    forceOverwrite          = False;
    noisy                   = True;
@@ -1794,6 +3525,7 @@ IntNative main ( IntNative argc, Char *argv[] )
    numFileNames            = 0;
    numFilesProcessed       = 0;
    workFactor              = 30;
+   numThreads              = onlineCPUs();
    deleteOutputOnInterrupt = False;
    exitValue               = 0;
    i = j = 0; /* avoid bogus warning from egcs-1.1.X */
@@ -1872,6 +3604,7 @@ IntNative main ( IntNative argc, Char *argv[] )
                case 'f': forceOverwrite   = True; break;
                case 't': opMode           = OM_TEST; break;
                case 'k': keepInputFiles   = True; break;
+               case 'r': recursive        = True; break;
                case 's': smallMode        = True; break;
                case 'q': noisy            = False; break;
                case '1': blockSize100k    = 1; break;
@@ -1888,6 +3621,9 @@ IntNative main ( IntNative argc, Char *argv[] )
                          exit ( 0 );
                          break;
                case 'v': verbosity++; break;
+               case 'T': threadsFlag ( aa->name, &aa->name[j+1] );
+                         j = (Int32)strlen(aa->name) - 1;
+                         break;
                case 'h': usage ( progName );
                          exit ( 0 );
                          break;
@@ -1910,16 +3646,23 @@ IntNative main ( IntNative argc, Char *argv[] )
       if (ISFLAG("--force"))             forceOverwrite   = True;    else
       if (ISFLAG("--test"))              opMode           = OM_TEST; else
       if (ISFLAG("--keep"))              keepInputFiles   = True;    else
+      if (ISFLAG("--recursive"))         recursive        = True;    else
       if (ISFLAG("--small"))             smallMode        = True;    else
       if (ISFLAG("--quiet"))             noisy            = False;   else
       if (ISFLAG("--version"))           { license(); exit ( 0 ); }  else
       if (ISFLAG("--license"))           { license(); exit ( 0 ); }  else
       if (ISFLAG("--exponential"))       workFactor = 1;             else
+      if (ISFLAG("--linear-sort"))       workFactor = BZ_WORKFACTOR_LINEAR;
+                                                                     else
+      if (ISFLAG("--wide-table"))        wideMode         = True;    else
+      if (ISFLAG("--vmsplice"))          spliceMode       = True;    else
       if (ISFLAG("--repetitive-best"))   redundant(aa->name);        else
       if (ISFLAG("--repetitive-fast"))   redundant(aa->name);        else
       if (ISFLAG("--fast"))              blockSize100k = 1;          else
       if (ISFLAG("--best"))              blockSize100k = 9;          else
       if (ISFLAG("--verbose"))           verbosity++;                else
+      if (strncmp ( aa->name, "--threads=", 10 ) == 0)
+         threadsFlag ( aa->name, aa->name + 10 );                    else
       if (ISFLAG("--help"))              { usage ( progName ); exit ( 0 ); }
          else
          if (strncmp ( aa->name, "--", 2) == 0) {
@@ -1932,6 +3675,7 @@ IntNative main ( IntNative argc, Char *argv[] )
    if (verbosity > 4) verbosity = 4;
    if (opMode == OM_Z && smallMode && blockSize100k > 2)
       blockSize100k = 2;
+   if (smallMode) numThreads = 1;
 
    if (opMode == OM_TEST && srcMode == SM_F2O) {
       fprintf ( stderr, "%s: -c and -t cannot be used together.\n",
@@ -1942,6 +3686,14 @@ IntNative main ( IntNative argc, Char *argv[] )
    if (srcMode == SM_F2O && numFileNames == 0)
       srcMode = SM_I2O;
 
+#  ifndef BZ_BATCH
+   if (recursive && srcMode != SM_I2O) {
+      fprintf ( stderr, "%s: -r is not supported on this platform.\n",
+                progName );
+      exit ( 1 );
+   }
+#  endif
+
    if (opMode != OM_Z) blockSize100k = 0;
 
    if (srcMode == SM_F2F) {
@@ -1955,7 +3707,13 @@ IntNative main ( IntNative argc, Char *argv[] )
    if (opMode == OM_Z) {
       if (srcMode == SM_I2O) {
          compress ( NULL );
-      } else {
+      } else
+#     ifdef BZ_BATCH
+      if (recursive) {
+         runBatch ( argList );
+      } else
+#     endif
+      {
          decode = True;
          for (aa = argList; aa != NULL; aa = aa->link) {
             if (ISFLAG("--")) { decode = False; continue; }
@@ -1971,7 +3729,13 @@ IntNative main ( IntNative argc, Char *argv[] )
       unzFailsExist = False;
       if (srcMode == SM_I2O) {
          uncompress ( NULL );
-      } else {
+      } else
+#     ifdef BZ_BATCH
+      if (recursive) {
+         runBatch ( argList );
+      } else
+#     endif
+      {
          decode = True;
          for (aa = argList; aa != NULL; aa = aa->link) {
             if (ISFLAG("--")) { decode = False; continue; }
@@ -1990,7 +3754,13 @@ IntNative main ( IntNative argc, Char *argv[] )
       testFailsExist = False;
       if (srcMode == SM_I2O) {
          testf ( NULL );
-      } else {
+      } else
+#     ifdef BZ_BATCH
+      if (recursive) {
+         runBatch ( argList );
+      } else
+#     endif
+      {
          decode = True;
          for (aa = argList; aa != NULL; aa = aa->link) {
             if (ISFLAG("--")) { decode = False; continue; }
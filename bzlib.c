@@ -34,6 +34,10 @@
 #include "bzlib_private.h"
 #include "bz_version.h"
 
+#ifdef BZ_SSE2
+#include <emmintrin.h>
+#endif
+
 
 /*---------------------------------------------------*/
 /*--- Compression stuff                           ---*/
@@ -119,18 +123,26 @@ void default_bzfree ( void* opaque, void* addr )
 
 /*---------------------------------------------------*/
 static
-void prepare_new_block ( EState* s )
+void begin_new_block ( EState* s )
 {
    Int32 i;
    s->nblock = 0;
-   s->numZ = 0;
-   s->state_out_pos = 0;
    BZ_INITIALISE_CRC ( s->blockCRC );
    for (i = 0; i < 256; i++) s->inUse[i] = False;
    s->blockNo++;
 }
 
 
+/*---------------------------------------------------*/
+static
+void prepare_new_block ( EState* s )
+{
+   s->numZ = 0;
+   s->state_out_pos = 0;
+   begin_new_block ( s );
+}
+
+
 /*---------------------------------------------------*/
 static
 void init_RL ( EState* s )
@@ -163,7 +175,8 @@ int BZ_API(BZ2_bzCompressInit)
 
    if (strm == NULL ||
        blockSize100k < 1 || blockSize100k > 9 ||
-       workFactor < 0 || workFactor > 250)
+       workFactor < 0 ||
+       (workFactor > 250 && workFactor != BZ_WORKFACTOR_LINEAR))
      return BZ_PARAM_ERROR;
 
    if (workFactor == 0) workFactor = 30;
@@ -177,16 +190,25 @@ int BZ_API(BZ2_bzCompressInit)
    s->arr1 = NULL;
    s->arr2 = NULL;
    s->ftab = NULL;
+   s->sais = NULL;
+
+   s->sortPool  = NULL;
+   s->sortHelp  = NULL;
+   s->nSortHelp = 0;
 
    n       = 100000 * blockSize100k;
    s->arr1 = BZALLOC( n                  * sizeof(UInt32) );
    s->arr2 = BZALLOC( (n+BZ_N_OVERSHOOT) * sizeof(UInt32) );
    s->ftab = BZALLOC( 65537              * sizeof(UInt32) );
+   if (workFactor == BZ_WORKFACTOR_LINEAR)
+      s->sais = BZALLOC( (size_t)BZ_SAIS_WORDS(n) * sizeof(UInt32) );
 
-   if (s->arr1 == NULL || s->arr2 == NULL || s->ftab == NULL) {
+   if (s->arr1 == NULL || s->arr2 == NULL || s->ftab == NULL ||
+       (workFactor == BZ_WORKFACTOR_LINEAR && s->sais == NULL)) {
       if (s->arr1 != NULL) BZFREE(s->arr1);
       if (s->arr2 != NULL) BZFREE(s->arr2);
       if (s->ftab != NULL) BZFREE(s->ftab);
+      if (s->sais != NULL) BZFREE(s->sais);
       if (s       != NULL) BZFREE(s);
       return BZ_MEM_ERROR;
    }
@@ -204,6 +226,7 @@ int BZ_API(BZ2_bzCompressInit)
    s->mtfv              = (UInt16*)s->arr1;
    s->zbits             = NULL;
    s->ptr               = (UInt32*)s->arr1;
+   s->mt                = NULL;
 
    strm->state          = s;
    strm->total_in_lo32  = 0;
@@ -220,11 +243,7 @@ int BZ_API(BZ2_bzCompressInit)
 static
 void add_pair_to_block ( EState* s )
 {
-   Int32 i;
    UChar ch = (UChar)(s->state_in_ch);
-   for (i = 0; i < s->state_in_len; i++) {
-      BZ_UPDATE_CRC( s->blockCRC, ch );
-   }
    s->inUse[s->state_in_ch] = True;
    switch (s->state_in_len) {
       case 1:
@@ -256,7 +275,12 @@ void add_pair_to_block ( EState* s )
 static
 void flush_RL ( EState* s )
 {
-   if (s->state_in_ch < 256) add_pair_to_block ( s );
+   Int32 i;
+   if (s->state_in_ch < 256) {
+      for (i = 0; i < s->state_in_len; i++)
+         BZ_UPDATE_CRC ( s->blockCRC, s->state_in_ch );
+      add_pair_to_block ( s );
+   }
    init_RL ( s );
 }
 
@@ -269,7 +293,6 @@ void flush_RL ( EState* s )
    if (zchh != zs->state_in_ch &&                 \
        zs->state_in_len == 1) {                   \
       UChar ch = (UChar)(zs->state_in_ch);        \
-      BZ_UPDATE_CRC( zs->blockCRC, ch );          \
       zs->inUse[zs->state_in_ch] = True;          \
       zs->block[zs->nblock] = (UChar)ch;          \
       zs->nblock++;                               \
@@ -290,10 +313,88 @@ void flush_RL ( EState* s )
 
 
 /*---------------------------------------------------*/
+#ifdef BZ_SSE2
+
+#define ADVANCE_INPUT(zs,zn)                          \
+{                                                     \
+   UInt32 zlo = zs->strm->total_in_lo32;              \
+   zs->strm->next_in       += (zn);                   \
+   zs->strm->avail_in      -= (zn);                   \
+   zs->strm->total_in_lo32 += (zn);                   \
+   if (zs->strm->total_in_lo32 < zlo)                 \
+      zs->strm->total_in_hi32++;                      \
+}
+
+/*--
+   Takes what it can of the n bytes at p, 16 at a time,
+   and returns how many that was; ADD_CHAR_TO_BLOCK does
+   whatever is left.  p[-1] must be the byte last taken,
+   so that a held run of one is p[-1] itself.  While no
+   byte repeats the one before, each is a run of one and
+   goes into the block as it is; while bytes repeat the
+   held run they only lengthen it.  Either stretch stops
+   exactly where ADD_CHAR_TO_BLOCK would do otherwise,
+   and no earlier than the block-full check would.
+--*/
+static
+UInt32 add_spans_to_block ( EState* s, UChar* p, UInt32 n )
+{
+   UChar*  block  = s->block;
+   Int32   nblock = s->nblock;
+   UInt32  done   = 0;
+   UInt32  m, t;
+   Int32   i;
+   __m128i q, prev;
+
+   while (n - done >= 16) {
+      q = _mm_loadu_si128 ( (__m128i*)(p + done) );
+      if (s->state_in_len == 1) {
+         if (nblock + 16 > s->nblockMAX) break;
+         prev = _mm_loadu_si128 ( (__m128i*)(p + done - 1) );
+         m = (UInt32)_mm_movemask_epi8 ( _mm_cmpeq_epi8 ( prev, q ) );
+         t = (m == 0) ? 16 : (UInt32)__builtin_ctz ( m );
+         _mm_storeu_si128 ( (__m128i*)(block + nblock), prev );
+         for (i = 0; i < (Int32)t; i++) s->inUse[block[nblock + i]] = True;
+         nblock += (Int32)t;
+         if (t > 0) s->state_in_ch = p[done + t - 1];
+      } else {
+         m = (UInt32)_mm_movemask_epi8 (
+                _mm_cmpeq_epi8 ( q, _mm_set1_epi8 ( (char)s->state_in_ch ) ) );
+         t = (m == 0xffff) ? 16 : (UInt32)__builtin_ctz ( ~m );
+         if (t > (UInt32)(255 - s->state_in_len))
+            t = (UInt32)(255 - s->state_in_len);
+         s->state_in_len += (Int32)t;
+      }
+      done += t;
+      if (t < 16) break;
+   }
+
+   s->nblock = nblock;
+   return done;
+}
+
+#endif
+
+
+/*---------------------------------------------------*/
+/*--
+   The block CRC covers the input bytes which have gone
+   into the block, so not the run still held in state_in_*,
+   which may yet go into the next one.  Rather than CRC
+   each byte as its run is added, copy_input_until_stop
+   does the bytes it took in one go on the way out: the
+   run it started with, if that has been added since,
+   then what it read, less the run it leaves held.
+--*/
 static
 Bool copy_input_until_stop ( EState* s )
 {
-   Bool progress_in = False;
+   Bool    progress_in = False;
+   UChar*  in0  = (UChar*)(s->strm->next_in);
+   UInt32  ch0  = s->state_in_ch;
+   Int32   len0 = s->state_in_len;
+   UInt32  n;
+   Int32   i;
 
    if (s->mode == BZ_M_RUNNING) {
 
@@ -309,6 +410,13 @@ Bool copy_input_until_stop ( EState* s )
          s->strm->avail_in--;
          s->strm->total_in_lo32++;
          if (s->strm->total_in_lo32 == 0) s->strm->total_in_hi32++;
+#ifdef BZ_SSE2
+         if (s->strm->avail_in >= 16) {
+            n = add_spans_to_block ( s, (UChar*)(s->strm->next_in),
+                                     s->strm->avail_in );
+            ADVANCE_INPUT ( s, n );
+         }
+#endif
       }
 
    } else {
@@ -328,8 +436,26 @@ Bool copy_input_until_stop ( EState* s )
          s->strm->total_in_lo32++;
          if (s->strm->total_in_lo32 == 0) s->strm->total_in_hi32++;
          s->avail_in_expect--;
+#ifdef BZ_SSE2
+         if (s->strm->avail_in >= 16 && s->avail_in_expect >= 16) {
+            n = add_spans_to_block ( s, (UChar*)(s->strm->next_in),
+                                     s->strm->avail_in < s->avail_in_expect
+                                        ? s->strm->avail_in
+                                        : s->avail_in_expect );
+            ADVANCE_INPUT ( s, n );
+            s->avail_in_expect -= n;
+         }
+#endif
       }
    }
+
+   n = (UInt32)((UChar*)(s->strm->next_in) - in0);
+   if (s->state_in_ch < 256 && n >= (UInt32)s->state_in_len) {
+      if (ch0 < 256)
+         for (i = 0; i < len0; i++) BZ_UPDATE_CRC ( s->blockCRC, ch0 );
+      s->blockCRC = BZ2_crc32Update ( s->blockCRC, in0,
+                                      n - (UInt32)s->state_in_len );
+   }
    return progress_in;
 }
 
@@ -361,6 +487,268 @@ Bool copy_output_until_stop ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+/*--- Block-parallel compression                  ---*/
+/*---------------------------------------------------*/
+
+/*--
+   The calling thread still does the run-length coding
+   and the CRCs, filling s->block as usual.  When a block
+   is complete its buffers are swapped with those of a
+   free slot, and the slot is sorted and coded on the
+   pool.  Slots form a ring in block order, so finished
+   blocks are spliced into s->zbits strictly in turn.
+--*/
+
+/*---------------------------------------------------*/
+static
+void compress_job ( bz_job* j )
+{
+   BZ2_compressBlockFragment ( (EState*)j->arg );
+}
+
+
+/*---------------------------------------------------*/
+static
+void free_mt ( bz_stream* strm, bz_mtcomp* mt )
+{
+   Int32   i;
+   EState* b;
+
+   /*-- joins the workers, so nothing below is still in use --*/
+   if (mt->pool != NULL) BZ2_poolDestroy ( strm, mt->pool );
+
+   if (mt->slot != NULL) {
+      for (i = 0; i < mt->nSlots; i++) {
+         b = mt->slot[i];
+         if (b == NULL) continue;
+         if (b->arr1 != NULL) BZFREE(b->arr1);
+         if (b->arr2 != NULL) BZFREE(b->arr2);
+         if (b->ftab != NULL) BZFREE(b->ftab);
+         if (b->sais != NULL) BZFREE(b->sais);
+         if (b->sortHelp != NULL) BZFREE(b->sortHelp);
+         BZFREE(b);
+      }
+      BZFREE(mt->slot);
+   }
+   if (mt->job  != NULL) BZFREE(mt->job);
+   if (mt->zbuf != NULL) BZFREE(mt->zbuf);
+   BZFREE(mt);
+}
+
+
+/*---------------------------------------------------*/
+static
+void submit_block_mt ( EState* s )
+{
+   Int32      i;
+   UInt32*    tmp;
+   bz_mtcomp* mt = s->mt;
+   Int32      k  = (mt->head + mt->nBusy) % mt->nSlots;
+   EState*    b  = mt->slot[k];
+
+   /*-- the CRCs must be folded in block order, so do it here --*/
+   BZ_FINALISE_CRC ( s->blockCRC );
+   s->combinedCRC = (s->combinedCRC << 1) | (s->combinedCRC >> 31);
+   s->combinedCRC ^= s->blockCRC;
+
+   if (s->verbosity >= 2)
+      VPrintf4( "    block %d: crc = 0x%08x, "
+                "combined CRC = 0x%08x, size = %d\n",
+                s->blockNo, s->blockCRC, s->combinedCRC, s->nblock );
+
+   tmp = b->arr1; b->arr1 = s->arr1; s->arr1 = tmp;
+   tmp = b->arr2; b->arr2 = s->arr2; s->arr2 = tmp;
+   tmp = b->ftab; b->ftab = s->ftab; s->ftab = tmp;
+
+   b->block    = (UChar*)b->arr2;
+   b->mtfv     = (UInt16*)b->arr1;
+   b->ptr      = (UInt32*)b->arr1;
+   b->nblock   = s->nblock;
+   b->blockCRC = s->blockCRC;
+   b->blockNo  = s->blockNo;
+   for (i = 0; i < 256; i++) b->inUse[i] = s->inUse[i];
+
+   s->block    = (UChar*)s->arr2;
+   s->mtfv     = (UInt16*)s->arr1;
+   s->ptr      = (UInt32*)s->arr1;
+
+   BZ2_poolSubmit ( mt->pool, &mt->job[k] );
+   mt->nBusy++;
+
+   begin_new_block ( s );
+}
+
+
+/*---------------------------------------------------*/
+static
+Bool handle_compress_mt ( bz_stream* strm )
+{
+   Bool       progress_in  = False;
+   Bool       progress_out = False;
+   Bool       last;
+   EState*    s  = strm->state;
+   bz_mtcomp* mt = s->mt;
+
+   while (True) {
+
+      if (s->state_out_pos < s->numZ) {
+         progress_out |= copy_output_until_stop ( s );
+         if (s->state_out_pos < s->numZ) break;
+      }
+      s->state_out_pos = 0;
+      s->numZ = 0;
+
+      /*-- splice in the oldest block, if it is ready --*/
+      if (mt->nBusy > 0) {
+         if (s->state == BZ_S_OUTPUT)
+            BZ2_poolWait ( mt->pool, &mt->job[mt->head] );
+         if (BZ2_poolDone ( mt->pool, &mt->job[mt->head] )) {
+            BZ2_compressAppendFragment ( s, mt->slot[mt->head] );
+            mt->head = (mt->head + 1) % mt->nSlots;
+            mt->nBusy--;
+            continue;
+         }
+      }
+
+      if (s->state == BZ_S_OUTPUT) {
+         /*-- every block of this flush/finish has been spliced --*/
+         if (s->mode == BZ_M_FINISHING) {
+            if (mt->trailerDone) break;
+            BZ2_compressStreamTrailer ( s );
+            mt->trailerDone = True;
+            continue;
+         }
+         s->state = BZ_S_INPUT;
+         break;
+      }
+
+      progress_in |= copy_input_until_stop ( s );
+      last = (Bool)(s->mode != BZ_M_RUNNING && s->avail_in_expect == 0);
+      if (last) flush_RL ( s );
+
+      if (s->nblock >= s->nblockMAX || (last && s->nblock > 0)) {
+         if (mt->nBusy == mt->nSlots) {
+            BZ2_poolWait ( mt->pool, &mt->job[mt->head] );
+            continue;
+         }
+         submit_block_mt ( s );
+      }
+
+      if (last) {
+         s->state = BZ_S_OUTPUT;
+         continue;
+      }
+      if (s->strm->avail_in == 0) break;
+   }
+
+   return progress_in || progress_out;
+}
+
+
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzCompressInitMT)
+                    ( bz_stream* strm,
+                     int        blockSize100k,
+                     int        verbosity,
+                     int        workFactor,
+                     int        nThreads )
+{
+   Int32      i, n, ret;
+   EState*    s;
+   EState*    b;
+   bz_mtcomp* mt;
+
+   if (nThreads < 1 || nThreads > BZ_MAX_THREADS) return BZ_PARAM_ERROR;
+
+   ret = BZ2_bzCompressInit ( strm, blockSize100k, verbosity, workFactor );
+   if (ret != BZ_OK || nThreads == 1) return ret;
+
+   s  = strm->state;
+   n  = 100000 * blockSize100k;
+   mt = BZALLOC( sizeof(bz_mtcomp) );
+   if (mt == NULL) {
+      BZ2_bzCompressEnd ( strm );
+      return BZ_MEM_ERROR;
+   }
+
+   mt->pool        = NULL;
+   mt->nSlots      = nThreads;
+   mt->head        = 0;
+   mt->nBusy       = 0;
+   mt->trailerDone = False;
+   mt->job         = BZALLOC( (size_t)nThreads * sizeof(bz_job) );
+   mt->zbuf        = BZALLOC( (size_t)(n+BZ_N_OVERSHOOT) * sizeof(UInt32) );
+   mt->slot        = BZALLOC( (size_t)nThreads * sizeof(EState*) );
+   if (mt->slot != NULL)
+      for (i = 0; i < nThreads; i++) mt->slot[i] = NULL;
+   s->mt = mt;
+
+   if (mt->slot == NULL || mt->job == NULL || mt->zbuf == NULL) {
+      BZ2_bzCompressEnd ( strm );
+      return BZ_MEM_ERROR;
+   }
+
+   for (i = 0; i < nThreads; i++) {
+      b = BZALLOC( sizeof(EState) );
+      mt->slot[i] = b;
+      if (b == NULL) {
+         BZ2_bzCompressEnd ( strm );
+         return BZ_MEM_ERROR;
+      }
+      b->sais     = NULL;
+      b->sortPool = NULL;
+      b->sortHelp = NULL;
+
+      /*-- idle threads can help with a block's main sort --*/
+      b->nSortHelp = nThreads - 1;
+      if (b->nSortHelp > BZ_MAX_SORT_HELPERS)
+         b->nSortHelp = BZ_MAX_SORT_HELPERS;
+      if (s->sais != NULL) b->nSortHelp = 0;
+
+      b->arr1 = BZALLOC( (size_t)n                  * sizeof(UInt32) );
+      b->arr2 = BZALLOC( (size_t)(n+BZ_N_OVERSHOOT) * sizeof(UInt32) );
+      b->ftab = BZALLOC( 65537                      * sizeof(UInt32) );
+      if (s->sais != NULL)
+         b->sais = BZALLOC( (size_t)BZ_SAIS_WORDS(n) * sizeof(UInt32) );
+      if (b->nSortHelp > 0)
+         b->sortHelp = BZALLOC( (size_t)(b->nSortHelp + 1) *
+                                sizeof(bz_sorthelp) );
+      if (b->arr1 == NULL || b->arr2 == NULL || b->ftab == NULL ||
+          (s->sais != NULL && b->sais == NULL) ||
+          (b->nSortHelp > 0 && b->sortHelp == NULL)) {
+         BZ2_bzCompressEnd ( strm );
+         return BZ_MEM_ERROR;
+      }
+
+      b->strm          = strm;
+      b->mt            = NULL;
+      b->blockSize100k = s->blockSize100k;
+      b->nblockMAX     = s->nblockMAX;
+      b->verbosity     = s->verbosity;
+      b->workFactor    = s->workFactor;
+
+      mt->job[i].run   = compress_job;
+      mt->job[i].arg   = b;
+   }
+
+   /*-- only the slots ever sort --*/
+   if (s->sais != NULL) { BZFREE(s->sais); s->sais = NULL; }
+
+   mt->pool = BZ2_poolCreate ( strm, nThreads );
+   if (mt->pool == NULL) {
+      BZ2_bzCompressEnd ( strm );
+      return BZ_MEM_ERROR;
+   }
+   for (i = 0; i < nThreads; i++) mt->slot[i]->sortPool = mt->pool;
+
+   /*-- The stream header goes out ahead of any block. --*/
+   s->zbits = mt->zbuf;
+   BZ2_compressStreamHeader ( s );
+   return BZ_OK;
+}
+
+
 /*---------------------------------------------------*/
 static
 Bool handle_compress ( bz_stream* strm )
@@ -369,6 +757,8 @@ Bool handle_compress ( bz_stream* strm )
    Bool progress_out = False;
    EState* s = strm->state;
 
+   if (s->mt != NULL) return handle_compress_mt ( strm );
+
    while (True) {
 
       if (s->state == BZ_S_OUTPUT) {
@@ -478,9 +868,11 @@ int BZ_API(BZ2_bzCompressEnd)  ( bz_stream *strm )
    if (s == NULL) return BZ_PARAM_ERROR;
    if (s->strm != strm) return BZ_PARAM_ERROR;
 
+   if (s->mt   != NULL) free_mt ( strm, s->mt );
    if (s->arr1 != NULL) BZFREE(s->arr1);
    if (s->arr2 != NULL) BZFREE(s->arr2);
    if (s->ftab != NULL) BZFREE(s->ftab);
+   if (s->sais != NULL) BZFREE(s->sais);
    BZFREE(strm->state);
 
    strm->state = NULL;
@@ -504,7 +896,8 @@ int BZ_API(BZ2_bzDecompressInit)
    if (!bz_config_ok()) return BZ_CONFIG_ERROR;
 
    if (strm == NULL) return BZ_PARAM_ERROR;
-   if (small != 0 && small != 1) return BZ_PARAM_ERROR;
+   if (small != 0 && small != 1 && small != BZ_SMALL_WIDE)
+      return BZ_PARAM_ERROR;
    if (verbosity < 0 || verbosity > 4) return BZ_PARAM_ERROR;
 
    if (strm->bzalloc == NULL) strm->bzalloc = default_bzalloc;
@@ -522,12 +915,15 @@ int BZ_API(BZ2_bzDecompressInit)
    strm->total_in_hi32      = 0;
    strm->total_out_lo32     = 0;
    strm->total_out_hi32     = 0;
-   s->smallDecompress       = (Bool)small;
+   s->smallDecompress       = (Bool)(small == 1);
+   s->wideDecompress        = (Bool)(small == BZ_SMALL_WIDE);
    s->ll4                   = NULL;
    s->ll16                  = NULL;
    s->tt                    = NULL;
+   s->tw                    = NULL;
    s->currBlockNo           = 0;
    s->verbosity             = verbosity;
+   s->mt                    = NULL;
 
    return BZ_OK;
 }
@@ -550,7 +946,6 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
             if (s->strm->avail_out == 0) return False;
             if (s->state_out_len == 0) break;
             *( (UChar*)(s->strm->next_out) ) = s->state_out_ch;
-            BZ_UPDATE_CRC ( s->calculatedBlockCRC, s->state_out_ch );
             s->state_out_len--;
             s->strm->next_out++;
             s->strm->avail_out--;
@@ -594,7 +989,6 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
    } else {
 
       /* restore */
-      UInt32        c_calculatedBlockCRC = s->calculatedBlockCRC;
       UChar         c_state_out_ch       = s->state_out_ch;
       Int32         c_state_out_len      = s->state_out_len;
       Int32         c_nblock_used        = s->nblock_used;
@@ -614,11 +1008,23 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
 
          /* try to finish existing run */
          if (c_state_out_len > 0) {
+#ifdef BZ_SSE2
+            /*-- Long runs go out 16 bytes per store, always
+                 leaving at least one byte for the loop below. --*/
+            if (c_state_out_len > 16 && cs_avail_out >= 16) {
+               __m128i run = _mm_set1_epi8 ( (char)c_state_out_ch );
+               do {
+                  _mm_storeu_si128 ( (__m128i*)cs_next_out, run );
+                  c_state_out_len -= 16;
+                  cs_next_out     += 16;
+                  cs_avail_out    -= 16;
+               } while (c_state_out_len > 16 && cs_avail_out >= 16);
+            }
+#endif
             while (True) {
                if (cs_avail_out == 0) goto return_notr;
                if (c_state_out_len == 1) break;
                *( (UChar*)(cs_next_out) ) = c_state_out_ch;
-               BZ_UPDATE_CRC ( c_calculatedBlockCRC, c_state_out_ch );
                c_state_out_len--;
                cs_next_out++;
                cs_avail_out--;
@@ -629,7 +1035,6 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
                   c_state_out_len = 1; goto return_notr;
                };
                *( (UChar*)(cs_next_out) ) = c_state_out_ch;
-               BZ_UPDATE_CRC ( c_calculatedBlockCRC, c_state_out_ch );
                cs_next_out++;
                cs_avail_out--;
             }
@@ -672,7 +1077,6 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
          s->strm->total_out_hi32++;
 
       /* save */
-      s->calculatedBlockCRC = c_calculatedBlockCRC;
       s->state_out_ch       = c_state_out_ch;
       s->state_out_len      = c_state_out_len;
       s->nblock_used        = c_nblock_used;
@@ -720,7 +1124,6 @@ Bool unRLE_obuf_to_output_SMALL ( DState* s )
             if (s->strm->avail_out == 0) return False;
             if (s->state_out_len == 0) break;
             *( (UChar*)(s->strm->next_out) ) = s->state_out_ch;
-            BZ_UPDATE_CRC ( s->calculatedBlockCRC, s->state_out_ch );
             s->state_out_len--;
             s->strm->next_out++;
             s->strm->avail_out--;
@@ -769,7 +1172,6 @@ Bool unRLE_obuf_to_output_SMALL ( DState* s )
             if (s->strm->avail_out == 0) return False;
             if (s->state_out_len == 0) break;
             *( (UChar*)(s->strm->next_out) ) = s->state_out_ch;
-            BZ_UPDATE_CRC ( s->calculatedBlockCRC, s->state_out_ch );
             s->state_out_len--;
             s->strm->next_out++;
             s->strm->avail_out--;
@@ -809,6 +1211,990 @@ Bool unRLE_obuf_to_output_SMALL ( DState* s )
 }
 
 
+/*---------------------------------------------------*/
+/*--
+   Both of the above write one contiguous stretch of
+   next_out per call, so the block CRC is brought up to
+   date over that stretch in one go here.
+--*/
+static
+Bool unRLE_obuf_to_output ( DState* s )
+{
+   UChar* out0 = (UChar*)(s->strm->next_out);
+   Bool   corrupt;
+
+   if (s->smallDecompress)
+      corrupt = unRLE_obuf_to_output_SMALL ( s ); else
+      corrupt = unRLE_obuf_to_output_FAST  ( s );
+   s->calculatedBlockCRC =
+      BZ2_crc32Update ( s->calculatedBlockCRC, out0,
+                        (UInt32)((UChar*)(s->strm->next_out) - out0) );
+   return corrupt;
+}
+
+
+/*---------------------------------------------------*/
+/*--- Block-parallel decompression                ---*/
+/*---------------------------------------------------*/
+
+/*--
+   Blocks are neither byte-aligned nor preceded by their
+   length, so the calling thread scans the compressed
+   input for the 48-bit block and end-of-stream magics,
+   as bzip2recover does.  Each candidate block is decoded
+   on the pool, up to the candidate after it.  The chain
+   is then followed from the stream header: a candidate
+   which does not start where the previous block ended
+   is a false one and its job is dropped, and a block
+   which runs past its candidate successor is decoded
+   again with a longer reach.  Blocks are written out in
+   order and both CRCs are checked as in the serial
+   decoder.
+
+   Input is only taken up to the end of the first
+   plausible stream-end magic, so that when the stream
+   does end there, whatever follows it is still with the
+   caller, exactly as with BZ2_bzDecompress.
+--*/
+
+#define BZ_MT_BLOCK_HI 0x3141
+#define BZ_MT_BLOCK_LO 0x59265359UL
+#define BZ_MT_EOS_HI   0x1772
+#define BZ_MT_EOS_LO   0x45385090UL
+
+#define BZ_MT_CHUNK    262144
+#define BZ_MT_MAXWIN   (1 << 27)
+
+/*-- decoded bytes held per slot, per 100k of block size --*/
+#define BZ_MT_OUTBUF   150000
+
+/*---------------------------------------------------*/
+static
+void add_total ( UInt32* lo32, UInt32* hi32, UInt32 n )
+{
+   *lo32 += n;
+   if (*lo32 < n) (*hi32)++;
+}
+
+
+/*---------------------------------------------------*/
+static
+void sub_total ( UInt32* lo32, UInt32* hi32, UInt32 n )
+{
+   if (*lo32 < n) (*hi32)--;
+   *lo32 -= n;
+}
+
+
+/*---------------------------------------------------*/
+static
+UInt32 get_bits32 ( UChar* p, Int32 pos )
+{
+   UInt32 a;
+   Int32  k = pos & 7;
+
+   p += pos >> 3;
+   a = ((UInt32)p[0] << 24) | ((UInt32)p[1] << 16) |
+       ((UInt32)p[2] << 8)  |  (UInt32)p[3];
+   if (k > 0) a = (a << k) | ((UInt32)p[4] >> (8 - k));
+   return a;
+}
+
+
+/*---------------------------------------------------*/
+static
+Int32 finish_block_mt ( DState* s, Bool* done )
+{
+   if (s->nblock_used == s->save_nblock+1 && s->state_out_len == 0) {
+      BZ_FINALISE_CRC ( s->calculatedBlockCRC );
+      if (s->calculatedBlockCRC != s->storedBlockCRC)
+         return BZ_DATA_ERROR;
+      *done = True;
+   }
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Following tt from one position to the next is a chain
+   of dependent loads, one cache miss per byte.  Here the
+   cycle is cut at BZ_MT_CHAINS places and the pieces are
+   walked side by side, so that that many misses are in
+   flight at once.  The cuts are marked with BZ_MT_START
+   in tt (positions take at most 20 of the upper 24 bits);
+   a chain ends where it meets a mark, and has then found
+   which piece follows it.  The pieces go into chunks of
+   the block's input buffer, which is not needed once the
+   block is decoded, and tt is then rewritten so that it
+   just runs straight through them, which the unchanged
+   unRLE_obuf_to_output_FAST reads at streaming speed.
+
+   The inner loop always steps all four lanes, checking
+   only for marks and damage; a lane whose chain has
+   ended shadows a live one and writes into a spare
+   chunk.  Chunk changes and chain ends are dealt with
+   one careful step at a time outside it.
+
+   Where the positions do not form one cycle, as with
+   corrupt input, nothing is changed and the ordinary
+   walk finds the damage as before.
+--*/
+#define BZ_MT_CHAINS   4
+#define BZ_MT_NCHUNK   128
+#define BZ_MT_WALKMIN  65536
+#define BZ_MT_START    0x80000000UL
+
+static
+void walk_chains_mt ( bz_dslot* d )
+{
+   DState* s  = d->ds;
+   UInt32* tt = s->tt;
+   UInt32  n  = (UInt32)s->save_nblock;
+   UInt32  pos   [BZ_MT_CHAINS];
+   UInt32  start [BZ_MT_CHAINS];
+   UChar*  wr    [BZ_MT_CHAINS];
+   UChar*  wrEnd [BZ_MT_CHAINS];
+   UChar*  lane  [BZ_MT_CHAINS];
+   Int32   first [BZ_MT_CHAINS];
+   Int32   last  [BZ_MT_CHAINS];
+   Int32   succ  [BZ_MT_CHAINS];
+   Int32   link  [BZ_MT_NCHUNK];
+   Int32   c, k, m, r, nLive, nUsed, chunk;
+   UInt32  e, i, total;
+   UInt32  p0, p1, p2, p3, e0, e1, e2, e3;
+   UChar   *w0, *w1, *w2, *w3;
+   UChar*  spare;
+   UChar*  p;
+   UChar*  pEnd;
+
+   chunk = d->inCap / BZ_MT_NCHUNK;
+   if (n < BZ_MT_WALKMIN || s->tPos >= n) return;
+
+   /*-- cut the cycle at tPos, where the walk must begin,
+        and at evenly spread positions --*/
+   m = 0;
+   for (c = 0; c < BZ_MT_CHAINS; c++) {
+      start[m] = (c == 0) ? s->tPos : (UInt32)c * (n / BZ_MT_CHAINS);
+      for (k = 0; k < m; k++) if (start[k] == start[m]) break;
+      if (k < m) continue;
+      tt[start[m]] |= BZ_MT_START;
+      m++;
+   }
+   for (c = 0; c < BZ_MT_CHAINS; c++) {
+      first[c] = last[c] = c;
+      link[c]  = -1;
+      succ[c]  = -1;
+   }
+   spare = d->inbuf + BZ_MT_CHAINS * chunk;
+   nUsed = BZ_MT_CHAINS + 1;
+
+   /*-- each chain takes its own start --*/
+   for (c = 0; c < m; c++) {
+      e = tt[start[c]];
+      wr[c]    = d->inbuf + c * chunk;
+      wrEnd[c] = wr[c] + chunk;
+      *(wr[c]++) = (UChar)e;
+      pos[c]   = (e >> 8) & 0x7fffff;
+   }
+   total = (UInt32)m;
+   nLive = m;
+
+   while (True) {
+
+      /*-- one careful step for each live chain --*/
+      for (c = 0; c < m; c++) {
+         if (succ[c] >= 0) continue;
+         if (pos[c] >= n) goto undo;
+         e = tt[pos[c]];
+         if (e & BZ_MT_START) {
+            for (k = 0; k < m; k++) if (start[k] == pos[c]) succ[c] = k;
+            nLive--;
+            continue;
+         }
+         if (total == n) goto undo;
+         if (wr[c] == wrEnd[c]) {
+            if (nUsed == BZ_MT_NCHUNK) goto undo;
+            link[last[c]] = nUsed;
+            link[nUsed]   = -1;
+            last[c]  = nUsed;
+            wr[c]    = d->inbuf + nUsed * chunk;
+            wrEnd[c] = wr[c] + chunk;
+            nUsed++;
+         }
+         *(wr[c]++) = (UChar)e;
+         pos[c] = e >> 8;
+         total++;
+      }
+      if (nLive == 0) break;
+
+      /*-- as many rounds as no chunk or the block can overrun --*/
+      r = (Int32)((n - total) / (UInt32)nLive);
+      for (c = 0; c < m; c++)
+         if (succ[c] < 0 && wrEnd[c] - wr[c] < r) r = (Int32)(wrEnd[c] - wr[c]);
+      if (r > chunk) r = chunk;
+      for (c = 0; c < BZ_MT_CHAINS; c++)
+         if (c < m && succ[c] < 0) lane[c] = wr[c]; else {
+            for (k = 0; succ[k] >= 0; k++) ;
+            pos[c]  = pos[k];
+            lane[c] = spare;
+         }
+
+      p0 = pos[0];  p1 = pos[1];  p2 = pos[2];  p3 = pos[3];
+      w0 = lane[0]; w1 = lane[1]; w2 = lane[2]; w3 = lane[3];
+      for (k = 0; k < r; k++) {
+         if ((p0 >= n) | (p1 >= n) | (p2 >= n) | (p3 >= n)) break;
+         e0 = tt[p0]; e1 = tt[p1]; e2 = tt[p2]; e3 = tt[p3];
+         if ((e0 | e1 | e2 | e3) & BZ_MT_START) break;
+         w0[k] = (UChar)e0; w1[k] = (UChar)e1;
+         w2[k] = (UChar)e2; w3[k] = (UChar)e3;
+         p0 = e0 >> 8; p1 = e1 >> 8; p2 = e2 >> 8; p3 = e3 >> 8;
+      }
+      pos[0] = p0; pos[1] = p1; pos[2] = p2; pos[3] = p3;
+      for (c = 0; c < m; c++)
+         if (succ[c] < 0) wr[c] += k;
+      total += (UInt32)(k * nLive);
+   }
+
+   for (c = 0; c < m; c++) tt[start[c]] &= ~(UInt32)BZ_MT_START;
+
+   /*-- the pieces must make up the whole block, in one cycle --*/
+   if (total != n) return;
+   c = 0;
+   for (k = 0; k < m; k++) {
+      c = succ[c];
+      if (c == 0) break;
+   }
+   if (c != 0 || k != m-1) return;
+
+   i = 0;
+   c = 0;
+   do {
+      for (k = first[c]; k >= 0; k = link[k]) {
+         p    = d->inbuf + k * chunk;
+         pEnd = (k == last[c]) ? wr[c] : p + chunk;
+         for (; p < pEnd; p++, i++) tt[i] = ((i + 1) << 8) | *p;
+      }
+      c = succ[c];
+   }
+      while (c != 0);
+   s->tPos = 0;
+   return;
+
+   undo:
+   for (c = 0; c < m; c++) tt[start[c]] &= ~(UInt32)BZ_MT_START;
+}
+
+
+/*---------------------------------------------------*/
+static
+void decompress_job ( bz_job* j )
+{
+   bz_dslot* d = (bz_dslot*)j->arg;
+   DState*   s = d->ds;
+   UInt32    outCap = (UInt32)s->blockSize100k * BZ_MT_OUTBUF;
+   Bool      corrupt;
+
+   d->blockDone      = False;
+   d->outLen         = 0;
+   d->outPos         = 0;
+   d->strm.next_in   = (char*)d->inbuf;
+   d->strm.avail_in  = (UInt32)d->inLen;
+
+   BZ2_decompressBlockInit ( s );
+   d->res = BZ2_decompress ( s );
+   if (d->res != BZ_OK) { d->res = BZ_DATA_ERROR; return; }
+   if (s->state != BZ_X_OUTPUT) { d->res = BZ_MT_SHORT; return; }
+   d->endBits = 8 * (d->inLen - (Int32)d->strm.avail_in) - s->bsLive;
+   if (!s->smallDecompress) walk_chains_mt ( d );
+
+   d->strm.next_out  = (char*)d->outbuf;
+   d->strm.avail_out = outCap;
+   corrupt = unRLE_obuf_to_output ( s );
+   d->outLen = (Int32)(outCap - d->strm.avail_out);
+   if (corrupt) { d->res = BZ_DATA_ERROR; return; }
+   d->res = finish_block_mt ( s, &d->blockDone );
+}
+
+
+/*---------------------------------------------------*/
+static
+void free_dmt ( bz_stream* strm, bz_mtdecomp* mt )
+{
+   Int32     i;
+   bz_dslot* d;
+
+   /*-- joins the workers, so nothing below is still in use --*/
+   if (mt->pool != NULL) BZ2_poolDestroy ( strm, mt->pool );
+
+   if (mt->slot != NULL) {
+      for (i = 0; i < mt->nSlots; i++) {
+         d = &mt->slot[i];
+         if (d->ds != NULL) {
+            if (d->ds->tt   != NULL) BZFREE(d->ds->tt);
+            if (d->ds->ll16 != NULL) BZFREE(d->ds->ll16);
+            if (d->ds->ll4  != NULL) BZFREE(d->ds->ll4);
+            BZFREE(d->ds);
+         }
+         if (d->inbuf  != NULL) BZFREE(d->inbuf);
+         if (d->outbuf != NULL) BZFREE(d->outbuf);
+      }
+      BZFREE(mt->slot);
+   }
+   if (mt->freeSlot != NULL) BZFREE(mt->freeSlot);
+   if (mt->ring     != NULL) BZFREE(mt->ring);
+   if (mt->win      != NULL) BZFREE(mt->win);
+   if (mt->cand     != NULL) BZFREE(mt->cand);
+   if (mt->candEOS  != NULL) BZFREE(mt->candEOS);
+   BZFREE(mt);
+}
+
+
+/*---------------------------------------------------*/
+static
+Bool add_candidate ( bz_stream* strm, Int32 pos, Bool eos )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   Int32        i;
+   Int32*       c;
+   Bool*        e;
+
+   if (mt->nCand == mt->candCap) {
+      c = BZALLOC( (size_t)(2 * mt->candCap) * sizeof(Int32) );
+      e = BZALLOC( (size_t)(2 * mt->candCap) * sizeof(Bool) );
+      if (c == NULL || e == NULL) {
+         if (c != NULL) BZFREE(c);
+         if (e != NULL) BZFREE(e);
+         return False;
+      }
+      for (i = 0; i < mt->nCand; i++) {
+         c[i] = mt->cand[i];
+         e[i] = mt->candEOS[i];
+      }
+      BZFREE(mt->cand);
+      BZFREE(mt->candEOS);
+      mt->cand    = c;
+      mt->candEOS = e;
+      mt->candCap *= 2;
+   }
+   mt->cand[mt->nCand]    = pos;
+   mt->candEOS[mt->nCand] = eos;
+   mt->nCand++;
+   return True;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   The first stream-end candidate not yet known to lie
+   inside a block, or -1.
+--*/
+static
+Int32 first_eos_mt ( bz_mtdecomp* mt )
+{
+   Int32 i;
+
+   for (i = 0; i < mt->nCand; i++)
+      if (mt->candEOS[i] && mt->cand[i] >= mt->eosFloor) return i;
+   return -1;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Examines the window for magics from scanPos on.  The
+   byte after a magic's first one pins down which of the
+   8 bit alignments can match, through magicTab, so most
+   positions cost a single lookup.  nNew is how much of
+   the window came from the caller's buffer just now; if
+   a stream-end candidate turns up, input beyond where
+   that stream would end is handed back.
+--*/
+static
+Int32 scan_input_mt ( bz_stream* strm, Int32 nNew )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   UChar*       w  = mt->win;
+   Int32        p, k, m, e, give;
+   UInt32       a, b, hi, lo;
+
+   while (mt->scanPos + 6 < mt->winLen) {
+      p = mt->scanPos;
+      m = mt->magicTab[w[p+1]];
+      if (m != 0) {
+         a = ((UInt32)w[p]   << 24) | ((UInt32)w[p+1] << 16) |
+             ((UInt32)w[p+2] << 8)  |  (UInt32)w[p+3];
+         b = ((UInt32)w[p+4] << 16) | ((UInt32)w[p+5] << 8) |
+              (UInt32)w[p+6];
+         for (k = 0; k < 8; k++) {
+            if ((m & (0x101 << k)) == 0) continue;
+            hi = ((a << k) >> 16) & 0xffff;
+            lo = (a << (k + 16)) | (b >> (8 - k));
+            if ((hi == BZ_MT_BLOCK_HI && lo == BZ_MT_BLOCK_LO) ||
+                (hi == BZ_MT_EOS_HI   && lo == BZ_MT_EOS_LO)) {
+               if (!add_candidate ( strm, 8 * p + k,
+                                    (Bool)(hi == BZ_MT_EOS_HI) ))
+                  return BZ_MEM_ERROR;
+            }
+         }
+      }
+      mt->scanPos++;
+   }
+
+   e = first_eos_mt ( mt );
+   if (e < 0) return BZ_OK;
+   give = mt->winLen - ((mt->cand[e] + 80 + 7) >> 3);
+   if (give > nNew) give = nNew;
+   if (give <= 0) return BZ_OK;
+
+   mt->winLen      -= give;
+   strm->next_in   -= give;
+   strm->avail_in  += (UInt32)give;
+   sub_total ( &strm->total_in_lo32, &strm->total_in_hi32, (UInt32)give );
+
+   /*-- magics no longer wholly in the window will be found again --*/
+   if (mt->scanPos > mt->winLen - 6) {
+      mt->scanPos = mt->winLen - 6;
+      while (mt->nCand > 0 && (mt->cand[mt->nCand-1] >> 3) >= mt->scanPos)
+         mt->nCand--;
+      if (mt->nDisp > mt->nCand) mt->nDisp = mt->nCand;
+   }
+   return BZ_OK;
+}
+
+
+/*---------------------------------------------------*/
+static
+void trim_window_mt ( bz_mtdecomp* mt )
+{
+   Int32     i, n, bits;
+   bz_dslot* d;
+
+   n = mt->nextStart >> 3;
+   if (n == 0) return;
+   bits = 8 * n;
+
+   for (i = n; i < mt->winLen; i++) mt->win[i-n] = mt->win[i];
+   mt->winLen    -= n;
+   mt->scanPos   -= n;
+   mt->nextStart -= bits;
+   mt->eosFloor  -= bits;
+   for (i = 0; i < mt->nCand; i++) mt->cand[i] -= bits;
+   for (i = 0; i < mt->ringCount; i++) {
+      d = &mt->slot[mt->ring[(mt->ringHead + i) % mt->nSlots]];
+      d->start -= bits;
+      d->limit -= bits;
+   }
+}
+
+
+/*---------------------------------------------------*/
+static
+Int32 take_input_mt ( bz_stream* strm )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   Int32        i, n, cap;
+   UChar*       w;
+
+   n = BZ_MT_CHUNK;
+   if (strm->avail_in < (UInt32)n) n = (Int32)strm->avail_in;
+
+   if (mt->winLen + n > mt->winCap) trim_window_mt ( mt );
+   if (mt->winLen + n > mt->winCap) {
+      cap = 2 * mt->winCap;
+      while (cap < mt->winLen + n) cap *= 2;
+      w = BZALLOC( cap );
+      if (w == NULL) return BZ_MEM_ERROR;
+      for (i = 0; i < mt->winLen; i++) w[i] = mt->win[i];
+      BZFREE(mt->win);
+      mt->win    = w;
+      mt->winCap = cap;
+   }
+
+   for (i = 0; i < n; i++) mt->win[mt->winLen + i] = (UChar)strm->next_in[i];
+   mt->winLen     += n;
+   mt->fed         = True;
+   strm->next_in  += n;
+   strm->avail_in -= (UInt32)n;
+   add_total ( &strm->total_in_lo32, &strm->total_in_hi32, (UInt32)n );
+
+   if (!mt->haveHeader) return BZ_OK;
+   return scan_input_mt ( strm, n );
+}
+
+
+/*---------------------------------------------------*/
+static
+Bool room_for_input_mt ( bz_mtdecomp* mt )
+{
+   return (Bool)(mt->haveHeader && mt->nFree > 0 &&
+                 first_eos_mt ( mt ) < 0 &&
+                 mt->winLen - (mt->nextStart >> 3) < mt->winMax);
+}
+
+
+/*---------------------------------------------------*/
+static
+void fill_dslot ( bz_mtdecomp* mt, bz_dslot* d )
+{
+   Int32  i, k, n;
+   UChar* src;
+
+   if (d->limit - d->start > mt->maxBlockBits)
+      d->limit = d->start + mt->maxBlockBits;
+
+   /*-- realign to a byte boundary; the successor magic pads the end --*/
+   n   = (d->limit - d->start + 7) >> 3;
+   k   = d->start & 7;
+   src = mt->win + (d->start >> 3);
+   if (k == 0)
+      for (i = 0; i < n; i++) d->inbuf[i] = src[i]; else
+      for (i = 0; i < n; i++)
+         d->inbuf[i] = (UChar)((src[i] << k) | (src[i+1] >> (8 - k)));
+   d->inLen = n;
+}
+
+
+/*---------------------------------------------------*/
+static
+void submit_dslot ( bz_mtdecomp* mt, bz_dslot* d )
+{
+   fill_dslot ( mt, d );
+   BZ2_poolSubmit ( mt->pool, &d->job );
+}
+
+
+/*---------------------------------------------------*/
+static
+void dispatch_dmt ( bz_mtdecomp* mt )
+{
+   Int32     i, k;
+   bz_dslot* d;
+
+   while (mt->nFree > 0 && mt->nDisp + 1 < mt->nCand) {
+      i = mt->nDisp;
+      if (mt->candEOS[i] && mt->cand[i] >= mt->eosFloor) break;
+      mt->nDisp++;
+      if (mt->candEOS[i] || mt->cand[i] < mt->nextStart) continue;
+
+      k = mt->freeSlot[--mt->nFree];
+      d = &mt->slot[k];
+      d->start = mt->cand[i];
+      d->limit = mt->cand[i+1];
+      submit_dslot ( mt, d );
+      mt->ring[(mt->ringHead + mt->ringCount) % mt->nSlots] = k;
+      mt->ringCount++;
+   }
+}
+
+
+/*---------------------------------------------------*/
+static
+Int32 read_header_mt ( bz_stream* strm )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   Int32        i, n;
+   bz_dslot*    d;
+   DState*      b;
+
+   if (mt->winLen > 0 && mt->win[0] != BZ_HDR_B) return BZ_DATA_ERROR_MAGIC;
+   if (mt->winLen > 1 && mt->win[1] != BZ_HDR_Z) return BZ_DATA_ERROR_MAGIC;
+   if (mt->winLen > 2 && mt->win[2] != BZ_HDR_h) return BZ_DATA_ERROR_MAGIC;
+   if (mt->winLen < 4) return BZ_MT_NEED_INPUT;
+   if (mt->win[3] < BZ_HDR_0 + 1 ||
+       mt->win[3] > BZ_HDR_0 + 9) return BZ_DATA_ERROR_MAGIC;
+   s->blockSize100k = mt->win[3] - BZ_HDR_0;
+
+   n = s->blockSize100k * 100000;
+   mt->maxBlockBits = (n + 1) * 20 + 8 * 65536;
+   mt->winMax       = (mt->nSlots + 1) * (mt->maxBlockBits >> 3);
+   if (mt->winMax > BZ_MT_MAXWIN) mt->winMax = BZ_MT_MAXWIN;
+
+   for (i = 0; i < mt->nSlots; i++) {
+      d = &mt->slot[i];
+      b = BZALLOC( sizeof(DState) );
+      if (b == NULL) return BZ_MEM_ERROR;
+      b->tt   = NULL;
+      b->ll16 = NULL;
+      b->ll4  = NULL;
+      d->ds   = b;
+
+      d->inCap  = (mt->maxBlockBits >> 3) + 1;
+      d->inbuf  = BZALLOC( d->inCap );
+      d->outbuf = BZALLOC( s->blockSize100k * BZ_MT_OUTBUF );
+      if (d->inbuf == NULL || d->outbuf == NULL) return BZ_MEM_ERROR;
+      if (s->smallDecompress) {
+         b->ll16 = BZALLOC( (size_t)n * sizeof(UInt16) );
+         b->ll4  = BZALLOC( (size_t)((1 + n) >> 1) * sizeof(UChar) );
+         if (b->ll16 == NULL || b->ll4 == NULL) return BZ_MEM_ERROR;
+      } else {
+         b->tt   = BZALLOC( (size_t)n * sizeof(Int32) );
+         if (b->tt == NULL) return BZ_MEM_ERROR;
+      }
+
+      b->strm            = &d->strm;
+      b->blockSize100k   = s->blockSize100k;
+      b->smallDecompress = s->smallDecompress;
+      b->wideDecompress  = False;
+      b->verbosity       = 0;
+      b->currBlockNo     = 0;
+      b->mt              = NULL;
+      d->job.run         = decompress_job;
+      d->job.arg         = d;
+      mt->freeSlot[i]    = i;
+   }
+   mt->nFree      = mt->nSlots;
+   mt->haveHeader = True;
+
+   return scan_input_mt ( strm, mt->winLen ) == BZ_OK
+             ? BZ_MT_AGAIN : BZ_MEM_ERROR;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Takes the decoded block in slot k, at the head of the
+   ring, as the one at nextStart, and moves past it.
+--*/
+static
+void accept_dslot ( DState* s, Int32 k )
+{
+   bz_mtdecomp* mt = s->mt;
+   bz_dslot*    d  = &mt->slot[k];
+
+   s->calculatedCombinedCRC
+      = (s->calculatedCombinedCRC << 1) |
+           (s->calculatedCombinedCRC >> 31);
+   s->calculatedCombinedCRC ^= d->ds->storedBlockCRC;
+
+   mt->nextStart = d->start + d->endBits;
+   if (mt->eosFloor < mt->nextStart) mt->eosFloor = mt->nextStart;
+   mt->ringHead = (mt->ringHead + 1) % mt->nSlots;
+   mt->ringCount--;
+   mt->emit = k;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Settles what is at nextStart: the stream end, or a
+   block whose job has finished, in which case it is
+   made the one being written out.
+--*/
+static
+Int32 resolve_dmt ( bz_stream* strm )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   bz_dslot*    d;
+   Int32        i, k;
+
+   if (!mt->haveHeader) return read_header_mt ( strm );
+
+   /*-- forget candidates and jobs the chain has gone past --*/
+   for (i = 0; i < mt->nCand && mt->cand[i] < mt->nextStart; i++) ;
+   if (i > 0) {
+      for (k = i; k < mt->nCand; k++) {
+         mt->cand[k-i]    = mt->cand[k];
+         mt->candEOS[k-i] = mt->candEOS[k];
+      }
+      mt->nCand -= i;
+      mt->nDisp  = (mt->nDisp > i) ? mt->nDisp - i : 0;
+   }
+   while (mt->ringCount > 0) {
+      k = mt->ring[mt->ringHead];
+      d = &mt->slot[k];
+      if (d->start >= mt->nextStart) break;
+      BZ2_poolWait ( mt->pool, &d->job );
+      mt->freeSlot[mt->nFree++] = k;
+      mt->ringHead = (mt->ringHead + 1) % mt->nSlots;
+      mt->ringCount--;
+   }
+
+   if (mt->scanPos <= (mt->nextStart >> 3)) return BZ_MT_NEED_INPUT;
+   if (mt->nCand == 0 || mt->cand[0] != mt->nextStart) return BZ_DATA_ERROR;
+
+   if (mt->candEOS[0]) {
+      if (8 * mt->winLen < mt->nextStart + 80) return BZ_MT_NEED_INPUT;
+      s->storedCombinedCRC = get_bits32 ( mt->win, mt->nextStart + 48 );
+      mt->ended = True;
+      return BZ_MT_AGAIN;
+   }
+
+   /*-- not dispatched yet, which means its successor is unknown --*/
+   if (mt->ringCount == 0) return BZ_MT_NEED_INPUT;
+   k = mt->ring[mt->ringHead];
+   d = &mt->slot[k];
+   AssertH ( d->start == mt->nextStart, 4003 );
+
+   /*-- while input is arriving and there is room for it, go back
+        for more rather than wait; the window then keeps the
+        workers busy.  Once it is full, waiting here is what
+        holds the input back. --*/
+   if (mt->fed && room_for_input_mt ( mt ) &&
+       !BZ2_poolDone ( mt->pool, &d->job ))
+      return BZ_MT_NEED_INPUT;
+
+   BZ2_poolWait ( mt->pool, &d->job );
+
+   if (d->res == BZ_MT_SHORT) {
+      /*-- so the candidate it stopped at was a false one --*/
+      if (d->limit - d->start >= mt->maxBlockBits) return BZ_DATA_ERROR;
+      if (mt->eosFloor <= d->limit) mt->eosFloor = d->limit + 1;
+      for (i = 0; i < mt->nCand && mt->cand[i] <= d->limit; i++) ;
+      if (i == mt->nCand) return BZ_MT_NEED_INPUT;
+      d->limit = mt->cand[i];
+      submit_dslot ( mt, d );
+      return BZ_MT_AGAIN;
+   }
+   if (d->res != BZ_OK) return d->res;
+
+   accept_dslot ( s, k );
+   return BZ_MT_AGAIN;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   For a call that brought no input, when what is at
+   nextStart cannot be settled: the caller has nothing
+   more to give.  The block there is decoded as far as
+   the window goes on this thread, as the serial decoder
+   would have read it, so that damage in it is reported
+   the same way and not as a short file.  If it turns out
+   whole, it is written out.
+--*/
+static
+Int32 last_block_mt ( bz_stream* strm )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   bz_dslot*    d;
+   Int32        k;
+   Bool         fresh = (Bool)(mt->ringCount == 0);
+
+   if (!mt->haveHeader) return BZ_OK;
+   if (mt->nCand > 0 && mt->cand[0] == mt->nextStart &&
+       mt->candEOS[0]) return BZ_OK;
+
+   if (fresh) {
+      AssertH ( mt->nFree > 0, 4004 );
+      k = mt->freeSlot[--mt->nFree];
+   } else {
+      k = mt->ring[mt->ringHead];
+      BZ2_poolWait ( mt->pool, &mt->slot[k].job );
+      AssertH ( mt->slot[k].start == mt->nextStart, 4005 );
+   }
+   d = &mt->slot[k];
+
+   /*-- whole bytes only, so nothing past the window is read --*/
+   d->start = mt->nextStart;
+   d->limit = d->start + ((8 * mt->winLen - d->start) & ~7);
+   fill_dslot ( mt, d );
+   decompress_job ( &d->job );
+
+   if (d->res == BZ_MT_SHORT &&
+       d->limit - d->start >= mt->maxBlockBits) d->res = BZ_DATA_ERROR;
+   if (d->res != BZ_OK) {
+      if (fresh) mt->freeSlot[mt->nFree++] = k;
+      return (d->res == BZ_MT_SHORT) ? BZ_OK : d->res;
+   }
+
+   if (fresh) {
+      mt->ring[mt->ringHead] = k;
+      mt->ringCount = 1;
+   }
+   accept_dslot ( s, k );
+   return BZ_MT_AGAIN;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Writes out the block being emitted.  Returns BZ_OK
+   when the caller's buffer fills first, BZ_MT_AGAIN once
+   the whole block is out.
+--*/
+static
+Int32 emit_dmt ( bz_stream* strm )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   bz_dslot*    d  = &mt->slot[mt->emit];
+   DState*      b  = d->ds;
+   Int32        i, n;
+   Bool         corrupt;
+
+   n = d->outLen - d->outPos;
+   if ((UInt32)n > strm->avail_out) n = (Int32)strm->avail_out;
+   for (i = 0; i < n; i++) strm->next_out[i] = (char)d->outbuf[d->outPos + i];
+   d->outPos       += n;
+   strm->next_out  += n;
+   strm->avail_out -= (UInt32)n;
+   add_total ( &strm->total_out_lo32, &strm->total_out_hi32, (UInt32)n );
+   if (d->outPos < d->outLen) return BZ_OK;
+
+   if (!d->blockDone) {
+      /*-- outbuf was too small; finish straight into the caller's --*/
+      d->strm.next_out  = strm->next_out;
+      d->strm.avail_out = strm->avail_out;
+      corrupt = unRLE_obuf_to_output ( b );
+      n = (Int32)(strm->avail_out - d->strm.avail_out);
+      strm->next_out  = d->strm.next_out;
+      strm->avail_out = d->strm.avail_out;
+      add_total ( &strm->total_out_lo32, &strm->total_out_hi32, (UInt32)n );
+      if (corrupt) return BZ_DATA_ERROR;
+      if (finish_block_mt ( b, &d->blockDone ) != BZ_OK) return BZ_DATA_ERROR;
+      if (!d->blockDone) return BZ_OK;
+   }
+
+   s->currBlockNo++;
+   if (s->verbosity >= 2)
+      VPrintf1 ( "\n    [%d: huff+mtf rt+rld", s->currBlockNo );
+   if (s->verbosity >= 3)
+      VPrintf2 ( " {0x%08x, 0x%08x}", b->storedBlockCRC,
+                 b->calculatedBlockCRC );
+   if (s->verbosity >= 2) VPrintf0 ( "]" );
+
+   mt->freeSlot[mt->nFree++] = mt->emit;
+   mt->emit = -1;
+   return BZ_MT_AGAIN;
+}
+
+
+/*---------------------------------------------------*/
+static
+Int32 handle_decompress_mt ( bz_stream* strm )
+{
+   DState*      s  = strm->state;
+   bz_mtdecomp* mt = s->mt;
+   Int32        r;
+   Int32        tried = -1;
+
+   mt->fed = False;
+
+   while (True) {
+
+      if (mt->emit >= 0) {
+         r = emit_dmt ( strm );
+         if (r != BZ_MT_AGAIN) return r;
+         continue;
+      }
+
+      if (mt->ended) {
+         if (s->verbosity >= 3)
+            VPrintf2 ( "\n    combined CRCs: stored = 0x%08x, computed = 0x%08x",
+                       s->storedCombinedCRC, s->calculatedCombinedCRC );
+         if (s->calculatedCombinedCRC != s->storedCombinedCRC)
+            return BZ_DATA_ERROR;
+         s->state = BZ_X_IDLE;
+         return BZ_STREAM_END;
+      }
+
+      /*-- read ahead while there are idle slots to feed --*/
+      if (strm->avail_in > 0 && room_for_input_mt ( mt )) {
+         r = take_input_mt ( strm );
+         if (r != BZ_OK) return r;
+         dispatch_dmt ( mt );
+         continue;
+      }
+
+      dispatch_dmt ( mt );
+      r = resolve_dmt ( strm );
+      if (r == BZ_MT_NEED_INPUT) {
+         if (strm->avail_in > 0)
+            r = take_input_mt ( strm ); else
+         if (!mt->fed && tried != mt->nextStart) {
+            tried = mt->nextStart;
+            r = last_block_mt ( strm );
+         } else
+            return BZ_OK;
+      }
+      if (r != BZ_OK && r != BZ_MT_AGAIN) return r;
+   }
+}
+
+
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzDecompressInitMT)
+                     ( bz_stream* strm,
+                       int        verbosity,
+                       int        small,
+                       int        nThreads )
+{
+   Int32        i, k, ret;
+   DState*      s;
+   bz_mtdecomp* mt;
+
+   if (nThreads < 1 || nThreads > BZ_MAX_THREADS) return BZ_PARAM_ERROR;
+
+   ret = BZ2_bzDecompressInit ( strm, verbosity, small );
+   if (ret != BZ_OK || nThreads == 1) return ret;
+
+   s  = strm->state;
+   mt = BZALLOC( sizeof(bz_mtdecomp) );
+   if (mt == NULL) {
+      BZ2_bzDecompressEnd ( strm );
+      return BZ_MEM_ERROR;
+   }
+   s->mt = mt;
+
+   /*-- one slot more than threads, so a finished block can be
+        written out while every thread is busy --*/
+   mt->pool       = NULL;
+   mt->haveHeader = False;
+   mt->ended      = False;
+   mt->nSlots     = nThreads + 1;
+   mt->nFree      = 0;
+   mt->ringHead   = 0;
+   mt->ringCount  = 0;
+   mt->emit       = -1;
+   mt->winLen     = 0;
+   mt->winCap     = BZ_MT_CHUNK;
+   mt->scanPos    = 4;
+   mt->nCand      = 0;
+   mt->candCap    = 64;
+   mt->nDisp      = 0;
+   mt->nextStart  = 32;
+   mt->eosFloor   = 32;
+   mt->slot       = BZALLOC( (size_t)mt->nSlots * sizeof(bz_dslot) );
+   mt->freeSlot   = BZALLOC( (size_t)mt->nSlots * sizeof(Int32) );
+   mt->ring       = BZALLOC( (size_t)mt->nSlots * sizeof(Int32) );
+   mt->win        = BZALLOC( mt->winCap );
+   mt->cand       = BZALLOC( (size_t)mt->candCap * sizeof(Int32) );
+   mt->candEOS    = BZALLOC( (size_t)mt->candCap * sizeof(Bool) );
+   if (mt->slot != NULL)
+      for (i = 0; i < mt->nSlots; i++) {
+         mt->slot[i].ds     = NULL;
+         mt->slot[i].inbuf  = NULL;
+         mt->slot[i].outbuf = NULL;
+      }
+
+   if (mt->slot == NULL || mt->freeSlot == NULL || mt->ring == NULL ||
+       mt->win == NULL || mt->cand == NULL || mt->candEOS == NULL) {
+      BZ2_bzDecompressEnd ( strm );
+      return BZ_MEM_ERROR;
+   }
+
+   for (i = 0; i < 256; i++) mt->magicTab[i] = 0;
+   for (k = 0; k < 8; k++) {
+      mt->magicTab[(BZ_MT_BLOCK_HI >> k) & 0xff] |= (UInt16)(1 << k);
+      mt->magicTab[(BZ_MT_EOS_HI   >> k) & 0xff] |= (UInt16)(0x100 << k);
+   }
+
+   mt->pool = BZ2_poolCreate ( strm, nThreads );
+   if (mt->pool == NULL) {
+      BZ2_bzDecompressEnd ( strm );
+      return BZ_MEM_ERROR;
+   }
+   return BZ_OK;
+}
+
+
 /*---------------------------------------------------*/
 int BZ_API(BZ2_bzDecompress) ( bz_stream *strm )
 {
@@ -819,12 +2205,15 @@ int BZ_API(BZ2_bzDecompress) ( bz_stream *strm )
    if (s == NULL) return BZ_PARAM_ERROR;
    if (s->strm != strm) return BZ_PARAM_ERROR;
 
+   if (s->mt != NULL) {
+      if (s->state == BZ_X_IDLE) return BZ_SEQUENCE_ERROR;
+      return handle_decompress_mt ( strm );
+   }
+
    while (True) {
       if (s->state == BZ_X_IDLE) return BZ_SEQUENCE_ERROR;
       if (s->state == BZ_X_OUTPUT) {
-         if (s->smallDecompress)
-            corrupt = unRLE_obuf_to_output_SMALL ( s ); else
-            corrupt = unRLE_obuf_to_output_FAST  ( s );
+         corrupt = unRLE_obuf_to_output ( s );
          if (corrupt) return BZ_DATA_ERROR;
          if (s->nblock_used == s->save_nblock+1 && s->state_out_len == 0) {
             BZ_FINALISE_CRC ( s->calculatedBlockCRC );
@@ -873,8 +2262,10 @@ int BZ_API(BZ2_bzDecompressEnd)  ( bz_stream *strm )
    if (s->strm != strm) return BZ_PARAM_ERROR;
 
    if (s->tt   != NULL) BZFREE(s->tt);
+   if (s->tw   != NULL) BZFREE(s->tw);
    if (s->ll16 != NULL) BZFREE(s->ll16);
    if (s->ll4  != NULL) BZFREE(s->ll4);
+   if (s->mt   != NULL) free_dmt ( strm, s->mt );
 
    BZFREE(strm->state);
    strm->state = NULL;
@@ -924,6 +2315,20 @@ BZFILE* BZ_API(BZ2_bzWriteOpen)
                       int   blockSize100k,
                       int   verbosity,
                       int   workFactor )
+{
+   return BZ2_bzWriteOpenMT ( bzerror, f, blockSize100k,
+                              verbosity, workFactor, 1 );
+}
+
+
+/*---------------------------------------------------*/
+BZFILE* BZ_API(BZ2_bzWriteOpenMT)
+                    ( int*  bzerror,
+                      FILE* f,
+                      int   blockSize100k,
+                      int   verbosity,
+                      int   workFactor,
+                      int   nThreads )
 {
    Int32   ret;
    bzFile* bzf = NULL;
@@ -932,8 +2337,10 @@ BZFILE* BZ_API(BZ2_bzWriteOpen)
 
    if (f == NULL ||
        (blockSize100k < 1 || blockSize100k > 9) ||
-       (workFactor < 0 || workFactor > 250) ||
-       (verbosity < 0 || verbosity > 4))
+       (workFactor < 0 ||
+        (workFactor > 250 && workFactor != BZ_WORKFACTOR_LINEAR)) ||
+       (verbosity < 0 || verbosity > 4) ||
+       (nThreads < 1 || nThreads > BZ_MAX_THREADS))
       { BZ_SETERR(BZ_PARAM_ERROR); return NULL; };
 
    if (ferror(f))
@@ -953,8 +2360,8 @@ BZFILE* BZ_API(BZ2_bzWriteOpen)
    bzf->strm.opaque   = NULL;
 
    if (workFactor == 0) workFactor = 30;
-   ret = BZ2_bzCompressInit ( &(bzf->strm), blockSize100k,
-                              verbosity, workFactor );
+   ret = BZ2_bzCompressInitMT ( &(bzf->strm), blockSize100k,
+                                verbosity, workFactor, nThreads );
    if (ret != BZ_OK)
       { BZ_SETERR(ret); free(bzf); return NULL; };
 
@@ -1096,6 +2503,21 @@ BZFILE* BZ_API(BZ2_bzReadOpen)
                      int   small,
                      void* unused,
                      int   nUnused )
+{
+   return BZ2_bzReadOpenMT ( bzerror, f, verbosity, small,
+                             unused, nUnused, 1 );
+}
+
+
+/*---------------------------------------------------*/
+BZFILE* BZ_API(BZ2_bzReadOpenMT)
+                   ( int*  bzerror,
+                     FILE* f,
+                     int   verbosity,
+                     int   small,
+                     void* unused,
+                     int   nUnused,
+                     int   nThreads )
 {
    bzFile* bzf = NULL;
    int     ret;
@@ -1103,7 +2525,8 @@ BZFILE* BZ_API(BZ2_bzReadOpen)
    BZ_SETERR(BZ_OK);
 
    if (f == NULL ||
-       (small != 0 && small != 1) ||
+       (small != 0 && small != 1 && small != BZ_SMALL_WIDE) ||
+       (nThreads < 1 || nThreads > BZ_MAX_THREADS) ||
        (verbosity < 0 || verbosity > 4) ||
        (unused == NULL && nUnused != 0) ||
        (unused != NULL && (nUnused < 0 || nUnused > BZ_MAX_UNUSED)))
@@ -1132,7 +2555,8 @@ BZFILE* BZ_API(BZ2_bzReadOpen)
       nUnused--;
    }
 
-   ret = BZ2_bzDecompressInit ( &(bzf->strm), verbosity, small );
+   ret = BZ2_bzDecompressInitMT ( &(bzf->strm), verbosity, small,
+                                  nThreads );
    if (ret != BZ_OK)
       { BZ_SETERR(ret); free(bzf); return NULL; };
 
@@ -1170,6 +2594,7 @@ int BZ_API(BZ2_bzRead)
              int     len )
 {
    Int32   n, ret;
+   UInt32  nIn;
    bzFile* bzf = (bzFile*)b;
 
    BZ_SETERR(BZ_OK);
@@ -1201,12 +2626,15 @@ int BZ_API(BZ2_bzRead)
          bzf->strm.next_in = bzf->buf;
       }
 
+      nIn = bzf->strm.avail_in;
       ret = BZ2_bzDecompress ( &(bzf->strm) );
 
       if (ret != BZ_OK && ret != BZ_STREAM_END)
          { BZ_SETERR(ret); return 0; };
 
-      if (ret == BZ_OK && myfeof(bzf->handle) &&
+      /*-- a multi-threaded stream may return early just to be
+           fed; only a call with nothing new to read is final --*/
+      if (ret == BZ_OK && myfeof(bzf->handle) && nIn == 0 &&
           bzf->strm.avail_in == 0 && bzf->strm.avail_out > 0)
          { BZ_SETERR(BZ_UNEXPECTED_EOF); return 0; };
 
@@ -1265,7 +2693,8 @@ int BZ_API(BZ2_bzBuffToBuffCompress)
        source == NULL ||
        blockSize100k < 1 || blockSize100k > 9 ||
        verbosity < 0 || verbosity > 4 ||
-       workFactor < 0 || workFactor > 250)
+       workFactor < 0 ||
+       (workFactor > 250 && workFactor != BZ_WORKFACTOR_LINEAR))
       return BZ_PARAM_ERROR;
 
    if (workFactor == 0) workFactor = 30;
@@ -1314,7 +2743,7 @@ int BZ_API(BZ2_bzBuffToBuffDecompress)
 
    if (dest == NULL || destLen == NULL ||
        source == NULL ||
-       (small != 0 && small != 1) ||
+       (small != 0 && small != 1 && small != BZ_SMALL_WIDE) ||
        verbosity < 0 || verbosity > 4)
           return BZ_PARAM_ERROR;
 
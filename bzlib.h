@@ -112,6 +112,19 @@ BZ_EXTERN int BZ_API(BZ2_bzCompressInit) (
       int        workFactor
    );
 
+#define BZ_MAX_THREADS 1024
+
+/*-- workFactor value selecting the linear-time block sorter --*/
+#define BZ_WORKFACTOR_LINEAR 251
+
+BZ_EXTERN int BZ_API(BZ2_bzCompressInitMT) (
+      bz_stream* strm,
+      int        blockSize100k,
+      int        verbosity,
+      int        workFactor,
+      int        nThreads
+   );
+
 BZ_EXTERN int BZ_API(BZ2_bzCompress) (
       bz_stream* strm,
       int action
@@ -121,12 +134,22 @@ BZ_EXTERN int BZ_API(BZ2_bzCompressEnd) (
       bz_stream* strm
    );
 
+/*-- small value selecting the two-bytes-per-lookup decoder --*/
+#define BZ_SMALL_WIDE 2
+
 BZ_EXTERN int BZ_API(BZ2_bzDecompressInit) (
       bz_stream *strm,
       int       verbosity,
       int       small
    );
 
+BZ_EXTERN int BZ_API(BZ2_bzDecompressInitMT) (
+      bz_stream *strm,
+      int       verbosity,
+      int       small,
+      int       nThreads
+   );
+
 BZ_EXTERN int BZ_API(BZ2_bzDecompress) (
       bz_stream* strm
    );
@@ -153,6 +176,16 @@ BZ_EXTERN BZFILE* BZ_API(BZ2_bzReadOpen) (
       int   nUnused
    );
 
+BZ_EXTERN BZFILE* BZ_API(BZ2_bzReadOpenMT) (
+      int*  bzerror,
+      FILE* f,
+      int   verbosity,
+      int   small,
+      void* unused,
+      int   nUnused,
+      int   nThreads
+   );
+
 BZ_EXTERN void BZ_API(BZ2_bzReadClose) (
       int*    bzerror,
       BZFILE* b
@@ -180,6 +213,15 @@ BZ_EXTERN BZFILE* BZ_API(BZ2_bzWriteOpen) (
       int   workFactor
    );
 
+BZ_EXTERN BZFILE* BZ_API(BZ2_bzWriteOpenMT) (
+      int*  bzerror,
+      FILE* f,
+      int   blockSize100k,
+      int   verbosity,
+      int   workFactor,
+      int   nThreads
+   );
+
 BZ_EXTERN void BZ_API(BZ2_bzWrite) (
       int*    bzerror,
       BZFILE* b,
@@ -47,6 +47,19 @@ typedef unsigned int    UInt32;
 typedef short           Int16;
 typedef unsigned short  UInt16;
 
+/*-- Bit buffers hold 64 bits where the compiler has a
+     64-bit integer, and 32 otherwise. --*/
+#if defined(__GNUC__)
+typedef unsigned long long BitBuff;
+#define BZ_BITBUFF_BITS 64
+#elif defined(_MSC_VER)
+typedef unsigned __int64   BitBuff;
+#define BZ_BITBUFF_BITS 64
+#else
+typedef unsigned int       BitBuff;
+#define BZ_BITBUFF_BITS 32
+#endif
+
 #define True  ((Bool)1)
 #define False ((Bool)0)
 
@@ -54,6 +67,18 @@ typedef unsigned short  UInt16;
 #define __inline__  /* */
 #endif
 
+/*-- x86 vector code, where the compiler offers it;
+     -DBZ_NO_SIMD builds the plain C versions instead. --*/
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(BZ_NO_SIMD)
+#define BZ_SSE2 1
+#endif
+
+/*-- Carry-less multiply CRC, chosen at run time; see crctable.c. --*/
+#if defined(BZ_SSE2) && defined(__x86_64__) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define BZ_CLMUL 1
+#endif
+
 #ifndef BZ_NO_STDIO
 
 extern void BZ2_bz__AssertH__fail ( int errcode );
@@ -116,6 +141,9 @@ extern void bz_internal_error ( int errcode );
 #define BZ_MAX_ALPHA_SIZE 258
 #define BZ_MAX_CODE_LEN    23
 
+/*-- bits looked up at once when decoding Huffman codes --*/
+#define BZ_LOOKUP_BITS     10
+
 #define BZ_RUNA 0
 #define BZ_RUNB 1
 
@@ -154,6 +182,7 @@ extern Int32 BZ2_rNums[512];
 /*-- Stuff for doing CRCs. --*/
 
 extern UInt32 BZ2_crc32Table[256];
+extern UInt32 BZ2_crc32Slice[7][256];
 
 #define BZ_INITIALISE_CRC(crcVar)              \
 {                                              \
@@ -172,6 +201,53 @@ extern UInt32 BZ2_crc32Table[256];
                            ((UChar)cha)];      \
 }
 
+extern UInt32
+BZ2_crc32Update ( UInt32, const UChar*, UInt32 );
+
+
+
+/*-- Work queue for the multi-threaded entry points. --*/
+
+#if defined(_WIN32) && !defined(BZ_NO_THREADS)
+#define BZ_NO_THREADS
+#endif
+
+typedef
+   struct bz_job {
+      void           (*run) ( struct bz_job* );
+      void*          arg;
+      Bool           done;
+      struct bz_job* next;
+   }
+   bz_job;
+
+typedef struct bz_pool bz_pool;
+
+/*--
+   With BZ_NO_THREADS, or if no thread could be started,
+   BZ2_poolSubmit runs the job on the calling thread.
+--*/
+extern bz_pool*
+BZ2_poolCreate ( bz_stream*, Int32 );
+
+extern void
+BZ2_poolSubmit ( bz_pool*, bz_job* );
+
+extern Bool
+BZ2_poolDone ( bz_pool*, bz_job* );
+
+extern void
+BZ2_poolWait ( bz_pool*, bz_job* );
+
+extern void
+BZ2_poolCancel ( bz_pool*, bz_job* );
+
+extern Int32
+BZ2_poolClaim ( bz_pool*, Int32* );
+
+extern void
+BZ2_poolDestroy ( bz_stream*, bz_pool* );
+
 
 
 /*-- States and modes for compression. --*/
@@ -192,6 +268,25 @@ extern UInt32 BZ2_crc32Table[256];
 
 
 
+/*--
+   A job lending a hand with one block's sort; see
+   sortShare in blocksort.c.  BZ_MAX_SORT_HELPERS bounds
+   how many a block may have.
+--*/
+
+#define BZ_MAX_SORT_HELPERS 31
+
+typedef
+   struct {
+      bz_job job;
+      void*  pass;
+      Int32  work;
+   }
+   bz_sorthelp;
+
+
+
+
 /*-- Structure holding all the compression-side stuff. --*/
 
 typedef
@@ -239,7 +334,7 @@ typedef
       UChar    unseqToSeq[256];
 
       /* the buffer for bit stream creation */
-      UInt32   bsBuff;
+      BitBuff  bsBuff;
       Int32    bsLive;
 
       /* block and combined CRCs */
@@ -259,15 +354,61 @@ typedef
 
       UChar    len     [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    code    [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
+      /* (code << 5) | len, so a symbol is sent with one load */
+      UInt32   codeLen [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    rfreq   [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       /* second dimension: only 3 needed; 4 makes index calculations faster */
       UInt32   len_pack[BZ_MAX_ALPHA_SIZE][4];
 
+      /* work space for the linear-time sort, else NULL */
+      UInt32*  sais;
+
+      /* jobs to share out the sort on sortPool, if any; */
+      /* nSortHelp helpers, plus one for the calling thread */
+      bz_pool*     sortPool;
+      bz_sorthelp* sortHelp;
+      Int32        nSortHelp;
+
+      /* valid bits in the last byte of a detached block's zbits, */
+      /* 0 meaning all 8 */
+      Int32    zbitsTail;
+
+      /* non-NULL for a stream set up by BZ2_bzCompressInitMT */
+      struct bz_mtcomp* mt;
+
    }
    EState;
 
 
 
+/*-- Block-parallel compression. --*/
+
+typedef
+   struct bz_mtcomp {
+      bz_pool* pool;
+
+      /* blocks in flight, in a ring ordered by block number */
+      Int32    nSlots;
+      Int32    head;
+      Int32    nBusy;
+      EState** slot;
+      bz_job*  job;
+
+      /* stitched output; the owning EState's zbits points here */
+      UChar*   zbuf;
+
+      Bool     trailerDone;
+   }
+   bz_mtcomp;
+
+
+
+/*-- Words of work space the linear-time sort needs. --*/
+
+#define BZ_SAIS_WORDS(nblock) ((nblock) + (nblock) / 16 + 512)
+
+
+
 /*-- externs for compression. --*/
 
 extern void
@@ -279,6 +420,18 @@ BZ2_compressBlock ( EState*, Bool );
 extern void
 BZ2_bsInitWrite ( EState* );
 
+extern void
+BZ2_compressStreamHeader ( EState* );
+
+extern void
+BZ2_compressStreamTrailer ( EState* );
+
+extern void
+BZ2_compressBlockFragment ( EState* );
+
+extern void
+BZ2_compressAppendFragment ( EState*, EState* );
+
 extern void
 BZ2_hbAssignCodes ( Int32*, UChar*, Int32, Int32, Int32 );
 
@@ -360,12 +513,13 @@ typedef
       BZ_RAND_DECLS;
 
       /* the buffer for bit stream reading */
-      UInt32   bsBuff;
+      BitBuff  bsBuff;
       Int32    bsLive;
 
       /* misc administratium */
       Int32    blockSize100k;
       Bool     smallDecompress;
+      Bool     wideDecompress;
       Int32    currBlockNo;
       Int32    verbosity;
 
@@ -381,6 +535,9 @@ typedef
       /* for undoing the Burrows-Wheeler transform (FAST) */
       UInt32   *tt;
 
+      /* for undoing the Burrows-Wheeler transform (WIDE) */
+      UInt32   *tw;
+
       /* for undoing the Burrows-Wheeler transform (SMALL) */
       UInt16   *ll16;
       UChar    *ll4;
@@ -409,6 +566,10 @@ typedef
       Int32    perm   [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
       Int32    minLens[BZ_N_GROUPS];
 
+      /* next BZ_LOOKUP_BITS bits -> (perm index << 5) | length, */
+      /* or 0 if the code is longer or bad */
+      UInt16   lookup [BZ_N_GROUPS][1 << BZ_LOOKUP_BITS];
+
       /* save area for scalars in the main decompress code */
       Int32    save_i;
       Int32    save_j;
@@ -434,12 +595,95 @@ typedef
       Int32*   save_gLimit;
       Int32*   save_gBase;
       Int32*   save_gPerm;
+      UInt16*  save_gLookup;
+
+      /* non-NULL for a stream set up by BZ2_bzDecompressInitMT */
+      struct bz_mtdecomp* mt;
 
    }
    DState;
 
 
 
+/*-- Block-parallel decompression. --*/
+
+/*--
+   All bit positions are relative to the start of the
+   window of compressed input held in bz_mtdecomp.
+--*/
+
+typedef
+   struct {
+      /* decodes one block, starting at its magic */
+      DState*   ds;
+      bz_stream strm;
+      bz_job    job;
+
+      /* bits [start, limit) of the window, realigned */
+      Int32     start;
+      Int32     limit;
+      UChar*    inbuf;
+      Int32     inLen;
+      Int32     inCap;
+
+      /* results, valid once the job is done */
+      Int32     res;
+      Int32     endBits;
+      Bool      blockDone;
+      UChar*    outbuf;
+      Int32     outLen;
+      Int32     outPos;
+   }
+   bz_dslot;
+
+typedef
+   struct bz_mtdecomp {
+      bz_pool*  pool;
+      Bool      haveHeader;
+      Bool      ended;
+
+      /* slots, and those in flight in stream order */
+      Int32     nSlots;
+      bz_dslot* slot;
+      Int32*    freeSlot;
+      Int32     nFree;
+      Int32*    ring;
+      Int32     ringHead;
+      Int32     ringCount;
+      Int32     emit;
+
+      /* compressed input not yet known to be consumed */
+      UChar*    win;
+      Int32     winLen;
+      Int32     winCap;
+      Int32     winMax;
+      Bool      fed;
+
+      /* bit offsets of possible block and stream-end magics */
+      UInt16    magicTab[256];
+      Int32     scanPos;
+      Int32*    cand;
+      Bool*     candEOS;
+      Int32     nCand;
+      Int32     candCap;
+      Int32     nDisp;
+
+      /* where the next block must start; stream-end magics */
+      /* below eosFloor are known to lie inside a block */
+      Int32     nextStart;
+      Int32     eosFloor;
+      Int32     maxBlockBits;
+   }
+   bz_mtdecomp;
+
+/*-- Job outcomes and internal returns, not seen by callers. --*/
+
+#define BZ_MT_SHORT      100
+#define BZ_MT_AGAIN      101
+#define BZ_MT_NEED_INPUT 102
+
+
+
 /*-- Macros for decompression. --*/
 
 #define BZ_GET_FAST(cccc)                     \
@@ -480,6 +724,13 @@ typedef
     s->tPos = GET_LL(s->tPos);
 
 
+/*-- Bytes for tw: an entry per position, then a symbol
+     for every 1 << BZ_WIDE_SHIFT positions. --*/
+
+#define BZ_WIDE_SHIFT 6
+#define BZ_WIDE_BYTES(n) ((n) * (Int32)sizeof(UInt32) + ((n) >> BZ_WIDE_SHIFT) + 1)
+
+
 /*-- externs for decompression. --*/
 
 extern Int32
@@ -489,7 +740,10 @@ extern Int32
 BZ2_decompress ( DState* );
 
 extern void
-BZ2_hbCreateDecodeTables ( Int32*, Int32*, Int32*, UChar*,
+BZ2_decompressBlockInit ( DState* );
+
+extern void
+BZ2_hbCreateDecodeTables ( Int32*, Int32*, Int32*, UInt16*, UChar*,
                            Int32,  Int32, Int32 );
 
 
@@ -31,6 +31,10 @@
 
 #include "bzlib_private.h"
 
+#ifdef BZ_SSE2
+#include <emmintrin.h>
+#endif
+
 
 /*---------------------------------------------------*/
 /*--- Bit stream I/O                              ---*/
@@ -44,12 +48,17 @@ void BZ2_bsInitWrite ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+/*-- The buffer fills from the top; this is its top byte. --*/
+#define bsTOP(bb) ((UChar)((bb) >> (BZ_BITBUFF_BITS - 8)))
+
+
 /*---------------------------------------------------*/
 static
 void bsFinishWrite ( EState* s )
 {
    while (s->bsLive > 0) {
-      s->zbits[s->numZ] = (UChar)(s->bsBuff >> 24);
+      s->zbits[s->numZ] = bsTOP(s->bsBuff);
       s->numZ++;
       s->bsBuff <<= 8;
       s->bsLive -= 8;
@@ -62,7 +71,7 @@ void bsFinishWrite ( EState* s )
 {                                             \
    while (s->bsLive >= 8) {                   \
       s->zbits[s->numZ]                       \
-         = (UChar)(s->bsBuff >> 24);          \
+         = bsTOP(s->bsBuff);                  \
       s->numZ++;                              \
       s->bsBuff <<= 8;                        \
       s->bsLive -= 8;                         \
@@ -70,14 +79,60 @@ void bsFinishWrite ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+/*--
+   Appends the n (at most 24) low bits of v to the
+   buffer bb holding bl bits.  A 64-bit buffer is
+   emptied only once it holds 32 bits or more, by
+   storing all 8 of its bytes and counting the whole
+   ones; the rest go out again with the next store.
+   zbits has plenty of room beyond any block for that.
+--*/
+#if BZ_BITBUFF_BITS == 64
+
+#define bsWRITE(bb,bl,nnn,vvv)                \
+{                                             \
+   if ((bl) >= 32) {                          \
+      UChar* zz = s->zbits + s->numZ;         \
+      zz[0] = (UChar)((bb) >> 56);            \
+      zz[1] = (UChar)((bb) >> 48);            \
+      zz[2] = (UChar)((bb) >> 40);            \
+      zz[3] = (UChar)((bb) >> 32);            \
+      zz[4] = (UChar)((bb) >> 24);            \
+      zz[5] = (UChar)((bb) >> 16);            \
+      zz[6] = (UChar)((bb) >> 8);             \
+      zz[7] = (UChar)(bb);                    \
+      s->numZ += (bl) >> 3;                   \
+      (bb) <<= (bl) & ~7;                     \
+      (bl) &= 7;                              \
+   }                                          \
+   (bb) |= (BitBuff)(vvv) << (64 - (bl) - (nnn)); \
+   (bl) += (nnn);                             \
+}
+
+#else
+
+#define bsWRITE(bb,bl,nnn,vvv)                \
+{                                             \
+   while ((bl) >= 8) {                        \
+      s->zbits[s->numZ] = bsTOP(bb);          \
+      s->numZ++;                              \
+      (bb) <<= 8;                             \
+      (bl) -= 8;                              \
+   }                                          \
+   (bb) |= (BitBuff)(vvv) << (32 - (bl) - (nnn)); \
+   (bl) += (nnn);                             \
+}
+
+#endif
+
+
 /*---------------------------------------------------*/
 static
 __inline__
 void bsW ( EState* s, Int32 n, UInt32 v )
 {
-   bsNEEDW ( n );
-   s->bsBuff |= (v << (32 - s->bsLive - n));
-   s->bsLive += n;
+   bsWRITE ( s->bsBuff, s->bsLive, n, v );
 }
 
 
@@ -118,6 +173,54 @@ void makeMaps_e ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+#ifdef BZ_SSE2
+
+/*--
+   Moves ll_i to the front of yy and returns where it
+   was, 16 entries at a time: one compare per 16 finds
+   it, and each 16 up to it shift along one place in a
+   register, taking in the last entry of the 16 before.
+   yy must hold a permutation of all 256 values, so the
+   entries past nInUse are read but never matched.
+--*/
+static
+__inline__
+Int32 mtfFront ( UChar* yy, UChar ll_i )
+{
+   __m128i key   = _mm_set1_epi8 ( (char)ll_i );
+   __m128i carry = _mm_cvtsi32_si128 ( ll_i );
+   __m128i v, sel;
+   UInt32  m;
+   Int32   k, r;
+
+   k = 0;
+   while (True) {
+      v = _mm_loadu_si128 ( (__m128i*)(yy+k) );
+      m = (UInt32)_mm_movemask_epi8 ( _mm_cmpeq_epi8 ( v, key ) );
+      if (m != 0) break;
+      _mm_storeu_si128 ( (__m128i*)(yy+k),
+                         _mm_or_si128 ( _mm_slli_si128 ( v, 1 ), carry ) );
+      carry = _mm_srli_si128 ( v, 15 );
+      k += 16;
+   }
+
+   /*-- the last 16 shift only as far as ll_i's old place --*/
+   r   = __builtin_ctz ( m );
+   sel = _mm_cmplt_epi8 ( _mm_setr_epi8 ( 0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15 ),
+                          _mm_set1_epi8 ( (char)(r+1) ) );
+   v   = _mm_or_si128 (
+            _mm_and_si128 ( sel, _mm_or_si128 ( _mm_slli_si128 ( v, 1 ),
+                                                carry ) ),
+            _mm_andnot_si128 ( sel, v ) );
+   _mm_storeu_si128 ( (__m128i*)(yy+k), v );
+   return k + r;
+}
+
+#endif
+
+
 /*---------------------------------------------------*/
 static
 void generateMTFValues ( EState* s )
@@ -161,7 +264,7 @@ void generateMTFValues ( EState* s )
 
    wr = 0;
    zPend = 0;
-   for (i = 0; i < s->nInUse; i++) yy[i] = (UChar) i;
+   for (i = 0; i < 256; i++) yy[i] = (UChar) i;
 
    for (i = 0; i < s->nblock; i++) {
       UChar ll_i;
@@ -189,6 +292,10 @@ void generateMTFValues ( EState* s )
             };
             zPend = 0;
          }
+#ifdef BZ_SSE2
+         j = mtfFront ( yy, ll_i );
+         mtfv[wr] = j+1; wr++; s->mtfFreq[j+1]++;
+#else
          {
             register UChar  rtmp;
             register UChar* ryy_j;
@@ -208,6 +315,7 @@ void generateMTFValues ( EState* s )
             j = ryy_j - &(yy[0]);
             mtfv[wr] = j+1; wr++; s->mtfFreq[j+1]++;
          }
+#endif
 
       }
    }
@@ -244,12 +352,16 @@ void sendMTFValues ( EState* s )
    Int32 v, t, i, j, gs, ge, totc, bt, bc, iter;
    Int32 nSelectors, alphaSize, minLen, maxLen, selCtr;
    Int32 nGroups, nBytes;
+   BitBuff bb;
+   Int32 bl;
+   UInt32* cl;
 
    /*--
    UChar  len [BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
    is a global since the decoder also needs it.
 
    Int32  code[BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
+   UInt32 codeLen[BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
    Int32  rfreq[BZ_N_GROUPS][BZ_MAX_ALPHA_SIZE];
    are also globals only used in this proc.
    Made global to keep stack frame size small.
@@ -492,6 +604,8 @@ void sendMTFValues ( EState* s )
       AssertH ( !(minLen < 1),  3005 );
       BZ2_hbAssignCodes ( &(s->code[t][0]), &(s->len[t][0]),
                           minLen, maxLen, alphaSize );
+      for (i = 0; i < alphaSize; i++)
+         s->codeLen[t][i] = ((UInt32)s->code[t][i] << 5) | s->len[t][i];
    }
 
    /*--- Transmit the mapping table. ---*/
@@ -548,25 +662,22 @@ void sendMTFValues ( EState* s )
    nBytes = s->numZ;
    selCtr = 0;
    gs = 0;
+   bb = s->bsBuff;
+   bl = s->bsLive;
    while (True) {
       if (gs >= s->nMTF) break;
       ge = gs + BZ_G_SIZE - 1;
       if (ge >= s->nMTF) ge = s->nMTF-1;
       AssertH ( s->selector[selCtr] < nGroups, 3006 );
+      cl = &(s->codeLen[s->selector[selCtr]][0]);
 
-      if (nGroups == 6 && 50 == ge-gs+1) {
+      if (50 == ge-gs+1) {
             /*--- fast track the common case ---*/
-            UInt16 mtfv_i;
-            UChar* s_len_sel_selCtr
-               = &(s->len[s->selector[selCtr]][0]);
-            Int32* s_code_sel_selCtr
-               = &(s->code[s->selector[selCtr]][0]);
+            UInt32 e;
 
 #           define BZ_ITAH(nn)                      \
-               mtfv_i = mtfv[gs+(nn)];              \
-               bsW ( s,                             \
-                     s_len_sel_selCtr[mtfv_i],      \
-                     s_code_sel_selCtr[mtfv_i] )
+               e = cl[mtfv[gs+(nn)]];               \
+               bsWRITE ( bb, bl, (Int32)(e & 31), e >> 5 )
 
             BZ_ITAH(0);  BZ_ITAH(1);  BZ_ITAH(2);  BZ_ITAH(3);  BZ_ITAH(4);
             BZ_ITAH(5);  BZ_ITAH(6);  BZ_ITAH(7);  BZ_ITAH(8);  BZ_ITAH(9);
@@ -584,15 +695,16 @@ void sendMTFValues ( EState* s )
       } else {
          /*--- slow version which correctly handles all situations ---*/
          for (i = gs; i <= ge; i++) {
-            bsW ( s,
-                  s->len  [s->selector[selCtr]] [mtfv[i]],
-                  s->code [s->selector[selCtr]] [mtfv[i]] );
+            UInt32 e = cl[mtfv[i]];
+            bsWRITE ( bb, bl, (Int32)(e & 31), e >> 5 );
          }
       }
 
       gs = ge+1;
       selCtr++;
    }
+   s->bsBuff = bb;
+   s->bsLive = bl;
    AssertH( selCtr == nSelectors, 3007 );
 
    if (s->verbosity >= 3)
@@ -600,6 +712,60 @@ void sendMTFValues ( EState* s )
 }
 
 
+/*---------------------------------------------------*/
+static
+void writeStreamHeader ( EState* s )
+{
+   BZ2_bsInitWrite ( s );
+   bsPutUChar ( s, BZ_HDR_B );
+   bsPutUChar ( s, BZ_HDR_Z );
+   bsPutUChar ( s, BZ_HDR_h );
+   bsPutUChar ( s, (UChar)(BZ_HDR_0 + s->blockSize100k) );
+}
+
+
+/*---------------------------------------------------*/
+static
+void writeBlock ( EState* s )
+{
+   bsPutUChar ( s, 0x31 ); bsPutUChar ( s, 0x41 );
+   bsPutUChar ( s, 0x59 ); bsPutUChar ( s, 0x26 );
+   bsPutUChar ( s, 0x53 ); bsPutUChar ( s, 0x59 );
+
+   /*-- Now the block's CRC, so it is in a known place. --*/
+   bsPutUInt32 ( s, s->blockCRC );
+
+   /*--
+      Now a single bit indicating (non-)randomisation.
+      As of version 0.9.5, we use a better sorting algorithm
+      which makes randomisation unnecessary.  So always set
+      the randomised bit to 'no'.  Of course, the decoder
+      still needs to be able to handle randomised blocks
+      so as to maintain backwards compatibility with
+      older versions of bzip2.
+   --*/
+   bsW(s,1,0);
+
+   bsW ( s, 24, s->origPtr );
+   generateMTFValues ( s );
+   sendMTFValues ( s );
+}
+
+
+/*---------------------------------------------------*/
+static
+void writeStreamTrailer ( EState* s )
+{
+   bsPutUChar ( s, 0x17 ); bsPutUChar ( s, 0x72 );
+   bsPutUChar ( s, 0x45 ); bsPutUChar ( s, 0x38 );
+   bsPutUChar ( s, 0x50 ); bsPutUChar ( s, 0x90 );
+   bsPutUInt32 ( s, s->combinedCRC );
+   if (s->verbosity >= 2)
+      VPrintf1( "    final combined CRC = 0x%08x\n   ", s->combinedCRC );
+   bsFinishWrite ( s );
+}
+
+
 /*---------------------------------------------------*/
 void BZ2_compressBlock ( EState* s, Bool is_last_block )
 {
@@ -621,51 +787,82 @@ void BZ2_compressBlock ( EState* s, Bool is_last_block )
    s->zbits = (UChar*) (&((UChar*)s->arr2)[s->nblock]);
 
    /*-- If this is the first block, create the stream header. --*/
-   if (s->blockNo == 1) {
-      BZ2_bsInitWrite ( s );
-      bsPutUChar ( s, BZ_HDR_B );
-      bsPutUChar ( s, BZ_HDR_Z );
-      bsPutUChar ( s, BZ_HDR_h );
-      bsPutUChar ( s, (UChar)(BZ_HDR_0 + s->blockSize100k) );
-   }
+   if (s->blockNo == 1) writeStreamHeader ( s );
 
-   if (s->nblock > 0) {
+   if (s->nblock > 0) writeBlock ( s );
 
-      bsPutUChar ( s, 0x31 ); bsPutUChar ( s, 0x41 );
-      bsPutUChar ( s, 0x59 ); bsPutUChar ( s, 0x26 );
-      bsPutUChar ( s, 0x53 ); bsPutUChar ( s, 0x59 );
+   /*-- If this is the last block, add the stream trailer. --*/
+   if (is_last_block) writeStreamTrailer ( s );
+}
 
-      /*-- Now the block's CRC, so it is in a known place. --*/
-      bsPutUInt32 ( s, s->blockCRC );
 
-      /*--
-         Now a single bit indicating (non-)randomisation.
-         As of version 0.9.5, we use a better sorting algorithm
-         which makes randomisation unnecessary.  So always set
-         the randomised bit to 'no'.  Of course, the decoder
-         still needs to be able to handle randomised blocks
-         so as to maintain backwards compatibility with
-         older versions of bzip2.
-      --*/
-      bsW(s,1,0);
+/*---------------------------------------------------*/
+/*--- Block-parallel compression                  ---*/
+/*---------------------------------------------------*/
 
-      bsW ( s, 24, s->origPtr );
-      generateMTFValues ( s );
-      sendMTFValues ( s );
-   }
+/*--
+   With BZ2_bzCompressInitMT, blocks are sorted and coded
+   on worker threads, each into a bit stream of its own
+   which starts at bit 0.  The calling thread keeps the
+   stream header, the combined CRC and the trailer, and
+   splices the finished blocks into its own bit stream in
+   input order.  Since bzip2 blocks are not byte aligned,
+   splicing is a bit-level copy, but the result is exactly
+   what BZ2_compressBlock would have produced.
+--*/
+
+/*---------------------------------------------------*/
+void BZ2_compressStreamHeader ( EState* s )
+{
+   writeStreamHeader ( s );
+}
 
 
-   /*-- If this is the last block, add the stream trailer. --*/
-   if (is_last_block) {
+/*---------------------------------------------------*/
+void BZ2_compressStreamTrailer ( EState* s )
+{
+   writeStreamTrailer ( s );
+}
 
-      bsPutUChar ( s, 0x17 ); bsPutUChar ( s, 0x72 );
-      bsPutUChar ( s, 0x45 ); bsPutUChar ( s, 0x38 );
-      bsPutUChar ( s, 0x50 ); bsPutUChar ( s, 0x90 );
-      bsPutUInt32 ( s, s->combinedCRC );
-      if (s->verbosity >= 2)
-         VPrintf1( "    final combined CRC = 0x%08x\n   ", s->combinedCRC );
-      bsFinishWrite ( s );
+
+/*---------------------------------------------------*/
+void BZ2_compressBlockFragment ( EState* s )
+{
+   /*-- s->blockCRC has already been finalised by the caller. --*/
+   BZ2_blockSort ( s );
+
+   s->zbits = (UChar*) (&((UChar*)s->arr2)[s->nblock]);
+   s->numZ  = 0;
+   BZ2_bsInitWrite ( s );
+   writeBlock ( s );
+
+   s->zbitsTail = s->bsLive & 7;
+   bsFinishWrite ( s );
+}
+
+
+/*---------------------------------------------------*/
+void BZ2_compressAppendFragment ( EState* s, EState* frag )
+{
+   Int32 i;
+   Int32 nFull = frag->numZ;
+
+   if (frag->zbitsTail > 0) nFull--;
+
+   /*-- flush whole bytes, so that an aligned stream can be copied --*/
+   bsNEEDW ( 0 );
+   if (s->bsLive == 0) {
+      for (i = 0; i < nFull; i++)
+         s->zbits[s->numZ + i] = frag->zbits[i];
+      s->numZ += nFull;
+   } else {
+      for (i = 0; i < nFull; i++)
+         bsW ( s, 8, (UInt32)frag->zbits[i] );
    }
+
+   if (frag->zbitsTail > 0)
+      bsW ( s, frag->zbitsTail,
+            (UInt32)(frag->zbits[nFull] >> (8 - frag->zbitsTail)) );
 }
 
 
@@ -24,6 +24,10 @@
 
 #include "bzlib_private.h"
 
+#ifdef BZ_SSE2
+#include <emmintrin.h>
+#endif
+
 
 /*---------------------------------------------------*/
 static
@@ -48,7 +52,7 @@ void makeMaps_d ( DState* s )
    while (True) {                                 \
       if (s->bsLive >= nnn) {                     \
          UInt32 v;                                \
-         v = (s->bsBuff >>                        \
+         v = (UInt32)(s->bsBuff >>                \
              (s->bsLive-nnn)) & ((1 << nnn)-1);   \
          s->bsLive -= nnn;                        \
          vvv = v;                                 \
@@ -86,22 +90,456 @@ void makeMaps_d ( DState* s )
       gLimit = &(s->limit[gSel][0]);              \
       gPerm = &(s->perm[gSel][0]);                \
       gBase = &(s->base[gSel][0]);                \
+      gLookup = &(s->lookup[gSel][0]);            \
    }                                              \
    groupPos--;                                    \
-   zn = gMinlen;                                  \
-   GET_BITS(label1, zvec, zn);                    \
-   while (1) {                                    \
-      if (zn > 20 /* the longest code */)         \
+   /*-- fast track: top up, then one lookup --*/  \
+   while (s->bsLive <= 24 &&                      \
+          s->strm->avail_in > 0) {                \
+      s->bsBuff                                   \
+         = (s->bsBuff << 8) |                     \
+           ((UInt32)                              \
+              (*((UChar*)(s->strm->next_in))));   \
+      s->bsLive += 8;                             \
+      s->strm->next_in++;                         \
+      s->strm->avail_in--;                        \
+      s->strm->total_in_lo32++;                   \
+      if (s->strm->total_in_lo32 == 0)            \
+         s->strm->total_in_hi32++;                \
+   }                                              \
+   zt = 0;                                        \
+   if (s->bsLive >= BZ_LOOKUP_BITS)               \
+      zt = gLookup[(s->bsBuff >>                  \
+                    (s->bsLive-BZ_LOOKUP_BITS))   \
+                   & ((1 << BZ_LOOKUP_BITS)-1)];  \
+   if (zt != 0) {                                 \
+      s->bsLive -= zt & 31;                       \
+      lval = gPerm[zt >> 5];                      \
+   } else {                                       \
+      zn = gMinlen;                               \
+      GET_BITS(label1, zvec, zn);                 \
+      while (1) {                                 \
+         if (zn > 20 /* the longest code */)      \
+            RETURN(BZ_DATA_ERROR);                \
+         if (zvec <= gLimit[zn]) break;           \
+         zn++;                                    \
+         GET_BIT(label2, zj);                     \
+         zvec = (zvec << 1) | zj;                 \
+      };                                          \
+      if (zvec - gBase[zn] < 0                    \
+          || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE) \
          RETURN(BZ_DATA_ERROR);                   \
-      if (zvec <= gLimit[zn]) break;              \
-      zn++;                                       \
-      GET_BIT(label2, zj);                        \
-      zvec = (zvec << 1) | zj;                    \
-   };                                             \
-   if (zvec - gBase[zn] < 0                       \
-       || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE)  \
-      RETURN(BZ_DATA_ERROR);                      \
-   lval = gPerm[zvec - gBase[zn]];                \
+      lval = gPerm[zvec - gBase[zn]];             \
+   }                                              \
+}
+
+
+/*---------------------------------------------------*/
+static
+void initSaveArea ( DState* s )
+{
+   s->save_i           = 0;
+   s->save_j           = 0;
+   s->save_t           = 0;
+   s->save_alphaSize   = 0;
+   s->save_nGroups     = 0;
+   s->save_nSelectors  = 0;
+   s->save_EOB         = 0;
+   s->save_groupNo     = 0;
+   s->save_groupPos    = 0;
+   s->save_nextSym     = 0;
+   s->save_nblockMAX   = 0;
+   s->save_nblock      = 0;
+   s->save_es          = 0;
+   s->save_N           = 0;
+   s->save_curr        = 0;
+   s->save_zt          = 0;
+   s->save_zn          = 0;
+   s->save_zvec        = 0;
+   s->save_zj          = 0;
+   s->save_gSel        = 0;
+   s->save_gMinlen     = 0;
+   s->save_gLimit      = NULL;
+   s->save_gBase       = NULL;
+   s->save_gPerm       = NULL;
+   s->save_gLookup     = NULL;
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Prepares s to decode a lone block, beginning at its
+   magic, for the multi-threaded decompressor.  The
+   caller has set blockSize100k and allocated tt (and
+   tw, or ll16 and ll4) already.
+--*/
+void BZ2_decompressBlockInit ( DState* s )
+{
+   s->state  = BZ_X_BLKHDR_1;
+   s->bsLive = 0;
+   s->bsBuff = 0;
+   initSaveArea ( s );
+}
+
+
+/*---------------------------------------------------*/
+#ifdef BZ_SSE2
+
+/*--
+   The list is simply mtfa[0 .. 255], with mtfbase[0]
+   always 0, and the entries in front of the one taken
+   shift along one place 16 at a time, each 16 taking in
+   the last entry of the 16 before, as generateMTFValues
+   does on the way in.  That needs no compaction, and
+   costs (nn / 16) + 1 steps in place of nn moves.
+--*/
+static
+__inline__
+UChar mtfDecode ( DState* s, Int32 nextSym )
+{
+   UChar*  yy = s->mtfa;
+   Int32   nn = nextSym - 1;
+   Int32   k  = 0;
+   UChar   uc = yy[nn];
+   __m128i carry = _mm_cvtsi32_si128 ( uc );
+   __m128i v, sel;
+
+   while (nn - k >= 16) {
+      v = _mm_loadu_si128 ( (__m128i*)(yy+k) );
+      _mm_storeu_si128 ( (__m128i*)(yy+k),
+                         _mm_or_si128 ( _mm_slli_si128 ( v, 1 ), carry ) );
+      carry = _mm_srli_si128 ( v, 15 );
+      k += 16;
+   }
+
+   /*-- the last 16 shift only as far as uc's old place --*/
+   v   = _mm_loadu_si128 ( (__m128i*)(yy+k) );
+   sel = _mm_cmplt_epi8 ( _mm_setr_epi8 ( 0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15 ),
+                          _mm_set1_epi8 ( (char)(nn-k+1) ) );
+   v   = _mm_or_si128 (
+            _mm_and_si128 ( sel, _mm_or_si128 ( _mm_slli_si128 ( v, 1 ),
+                                                carry ) ),
+            _mm_andnot_si128 ( sel, v ) );
+   _mm_storeu_si128 ( (__m128i*)(yy+k), v );
+   return uc;
+}
+
+#else
+
+/*-- uc = MTF ( nn ), for nn >= MTFL_SIZE --*/
+static
+UChar mtfDecodeFar ( DState* s, UInt32 nn )
+{
+   Int32 ii, jj, kk, pp, lno, off;
+   UChar uc;
+
+   lno = nn / MTFL_SIZE;
+   off = nn % MTFL_SIZE;
+   pp = s->mtfbase[lno] + off;
+   uc = s->mtfa[pp];
+   while (pp > s->mtfbase[lno]) {
+      s->mtfa[pp] = s->mtfa[pp-1]; pp--;
+   };
+   s->mtfbase[lno]++;
+   while (lno > 0) {
+      s->mtfbase[lno]--;
+      s->mtfa[s->mtfbase[lno]]
+         = s->mtfa[s->mtfbase[lno-1] + MTFL_SIZE - 1];
+      lno--;
+   }
+   s->mtfbase[0]--;
+   s->mtfa[s->mtfbase[0]] = uc;
+   if (s->mtfbase[0] == 0) {
+      kk = MTFA_SIZE-1;
+      for (ii = 256 / MTFL_SIZE-1; ii >= 0; ii--) {
+         for (jj = MTFL_SIZE-1; jj >= 0; jj--) {
+            s->mtfa[kk] = s->mtfa[s->mtfbase[ii] + jj];
+            kk--;
+         }
+         s->mtfbase[ii] = kk + 1;
+      }
+   }
+   return uc;
+}
+
+
+/*---------------------------------------------------*/
+/*-- uc = MTF ( nextSym-1 ) --*/
+static
+UChar mtfDecode ( DState* s, Int32 nextSym )
+{
+   Int32 pp;
+   UInt32 nn;
+   UChar uc;
+   nn = (UInt32)(nextSym - 1);
+
+   /* avoid general-case expense */
+   if (nn >= MTFL_SIZE) return mtfDecodeFar ( s, nn );
+
+   pp = s->mtfbase[0];
+   uc = s->mtfa[pp+nn];
+   while (nn > 3) {
+      Int32 z = pp+nn;
+      s->mtfa[(z)  ] = s->mtfa[(z)-1];
+      s->mtfa[(z)-1] = s->mtfa[(z)-2];
+      s->mtfa[(z)-2] = s->mtfa[(z)-3];
+      s->mtfa[(z)-3] = s->mtfa[(z)-4];
+      nn -= 4;
+   }
+   while (nn > 0) {
+      s->mtfa[(pp+nn)] = s->mtfa[(pp+nn)-1]; nn--;
+   };
+   s->mtfa[pp] = uc;
+   return uc;
+}
+
+#endif
+
+
+/*---------------------------------------------------*/
+/*--
+   The MTF/Huffman loop of BZ2_decompress without the
+   means to suspend.  Each step (a literal, or a whole
+   run of RUNA/RUNB and the symbol after it) decodes at
+   most 22 codes of at most 20 bits.  The buffer is
+   topped up before each code, 8 bytes at a time, only
+   while it holds fewer than 32 bits, so no read strays
+   more than 72 bytes past where the step began: a step
+   can start whenever BZ_FAST_MARGIN bytes of input
+   remain, with no further checks.  Everything lives in
+   locals, including the input position, and the stream
+   counters are brought up to date once, on the way out;
+   the caller picks up, at the top of its own loop,
+   wherever this stops.
+--*/
+#define BZ_FAST_MARGIN 80
+
+#if BZ_BITBUFF_BITS == 64
+
+static
+__inline__
+BitBuff load64be ( UChar* p )
+{
+   return ((BitBuff)p[0] << 56) | ((BitBuff)p[1] << 48) |
+          ((BitBuff)p[2] << 40) | ((BitBuff)p[3] << 32) |
+          ((BitBuff)p[4] << 24) | ((BitBuff)p[5] << 16) |
+          ((BitBuff)p[6] << 8)  |  (BitBuff)p[7];
+}
+
+/*-- leaves 56 to 63 bits in the buffer --*/
+#define FAST_FILL                                 \
+   if (live < 32) {                               \
+      Int32 kk = (63 - live) >> 3;                \
+      buff = (buff << (kk << 3)) |                \
+             (load64be ( in ) >> (64 - (kk << 3))); \
+      in   += kk;                                 \
+      live += kk << 3;                            \
+   }
+
+#else
+
+#define FAST_FILL                                 \
+   while (live < 25) {                            \
+      buff = (buff << 8) | (BitBuff)(*in++);      \
+      live += 8;                                  \
+   }
+
+#endif
+
+#define FAST_ERROR                                \
+   { retVal = BZ_DATA_ERROR; goto out; }
+
+#define FAST_MTF_VAL(lval)                        \
+{                                                 \
+   if (groupPos == 0) {                           \
+      groupNo++;                                  \
+      if (groupNo >= s->save_nSelectors)          \
+         FAST_ERROR;                              \
+      groupPos = BZ_G_SIZE;                       \
+      gSel = s->selector[groupNo];                \
+      gMinlen = s->minLens[gSel];                 \
+      gLimit = &(s->limit[gSel][0]);              \
+      gPerm = &(s->perm[gSel][0]);                \
+      gBase = &(s->base[gSel][0]);                \
+      gLookup = &(s->lookup[gSel][0]);            \
+   }                                              \
+   groupPos--;                                    \
+   FAST_FILL;                                     \
+   zt = gLookup[(buff >> (live-BZ_LOOKUP_BITS))   \
+                & ((1 << BZ_LOOKUP_BITS)-1)];     \
+   if (zt != 0) {                                 \
+      live -= zt & 31;                            \
+      lval = gPerm[zt >> 5];                      \
+   } else {                                       \
+      zn = gMinlen;                               \
+      live -= zn;                                 \
+      zvec = (Int32)(buff >> live) & ((1 << zn)-1); \
+      while (1) {                                 \
+         if (zn > 20 /* the longest code */)      \
+            FAST_ERROR;                           \
+         if (zvec <= gLimit[zn]) break;           \
+         zn++;                                    \
+         live--;                                  \
+         zvec = (zvec << 1) | ((Int32)(buff >> live) & 1); \
+      };                                          \
+      if (zvec - gBase[zn] < 0                    \
+          || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE) \
+         FAST_ERROR;                              \
+      lval = gPerm[zvec - gBase[zn]];             \
+   }                                              \
+}
+
+static
+Int32 decodeMTFFast ( DState* s )
+{
+   UChar*  in       = (UChar*)(s->strm->next_in);
+   UChar*  inStop   = in + s->strm->avail_in - BZ_FAST_MARGIN;
+   BitBuff buff     = s->bsBuff;
+   Int32   live     = s->bsLive;
+   Int32   EOB      = s->save_EOB;
+   Int32   nblockMAX = s->save_nblockMAX;
+   Int32   nblock   = s->save_nblock;
+   Int32   nextSym  = s->save_nextSym;
+   Int32   groupNo  = s->save_groupNo;
+   Int32   groupPos = s->save_groupPos;
+   Int32   gSel     = s->save_gSel;
+   Int32   gMinlen  = s->save_gMinlen;
+   Int32*  gLimit   = s->save_gLimit;
+   Int32*  gBase    = s->save_gBase;
+   Int32*  gPerm    = s->save_gPerm;
+   UInt16* gLookup  = s->save_gLookup;
+   Int32   retVal   = BZ_OK;
+   Int32   es, N, zt, zn, zvec;
+   UInt32  used;
+   UChar   uc;
+
+   while (nextSym != EOB && in <= inStop) {
+
+      if (nextSym == BZ_RUNA || nextSym == BZ_RUNB) {
+
+         es = -1;
+         N = 1;
+         do {
+            if (N >= 2*1024*1024) FAST_ERROR;
+            if (nextSym == BZ_RUNA) es = es + (0+1) * N; else
+            if (nextSym == BZ_RUNB) es = es + (1+1) * N;
+            N = N * 2;
+            FAST_MTF_VAL(nextSym);
+         }
+            while (nextSym == BZ_RUNA || nextSym == BZ_RUNB);
+
+         es++;
+         uc = s->seqToUnseq[ s->mtfa[s->mtfbase[0]] ];
+         s->unzftab[uc] += es;
+
+         if (es > nblockMAX - nblock) FAST_ERROR;
+         if (s->smallDecompress)
+            while (es > 0) {
+               s->ll16[nblock] = (UInt16)uc;
+               nblock++;
+               es--;
+            }
+         else
+            while (es > 0) {
+               s->tt[nblock] = (UInt32)uc;
+               nblock++;
+               es--;
+            };
+
+      } else {
+
+         if (nblock >= nblockMAX) FAST_ERROR;
+
+         uc = mtfDecode ( s, nextSym );
+
+         s->unzftab[s->seqToUnseq[uc]]++;
+         if (s->smallDecompress)
+            s->ll16[nblock] = (UInt16)(s->seqToUnseq[uc]); else
+            s->tt[nblock]   = (UInt32)(s->seqToUnseq[uc]);
+         nblock++;
+
+         FAST_MTF_VAL(nextSym);
+      }
+   }
+
+   out:
+   used = (UInt32)(in - (UChar*)(s->strm->next_in));
+   s->strm->next_in  = (char*)in;
+   s->strm->avail_in -= used;
+   s->strm->total_in_lo32 += used;
+   if (s->strm->total_in_lo32 < used)
+      s->strm->total_in_hi32++;
+   s->bsBuff         = buff;
+   s->bsLive         = live;
+   s->save_nblock    = nblock;
+   s->save_nextSym   = nextSym;
+   s->save_groupNo   = groupNo;
+   s->save_groupPos  = groupPos;
+   s->save_gSel      = gSel;
+   s->save_gMinlen   = gMinlen;
+   s->save_gLimit    = gLimit;
+   s->save_gBase     = gBase;
+   s->save_gPerm     = gPerm;
+   s->save_gLookup   = gLookup;
+   return retVal;
+}
+
+#undef FAST_FILL
+#undef FAST_ERROR
+#undef FAST_MTF_VAL
+
+
+/*---------------------------------------------------*/
+/*--
+   For BZ_SMALL_WIDE.  tt[i] holds the byte at i and the
+   position after it, and the byte at that next position
+   is the first symbol of the sorted rotation i, which
+   cftab gives without touching tt.  So if each entry of
+   tw holds the position two steps on instead, one load
+   per two bytes walks the block.  The bytes are written
+   back into tt in order, for unRLE_obuf_to_output_FAST
+   to read straight through.
+
+   Every position in tt is below nblock, so the walk
+   stays in bounds even when the data is corrupt; the
+   block CRC then catches it as before.
+--*/
+static
+void unBWT_wide ( DState* s, Int32 nblock )
+{
+   UInt32* tt = s->tt;
+   UInt32* tw = s->tw;
+   UChar*  fb = (UChar*)(tw + nblock);
+   Int32*  cf = s->cftab;
+   UInt32  e, f, p;
+   Int32   i;
+
+   for (i = 0; i < nblock; i++) {
+      e = tt[i];
+      tw[i] = (tt[e >> 8] & 0xffffff00) | (e & 0xff);
+   }
+
+   /*-- cftab[c] now ends symbol c's range; fb[j] is the
+        symbol at j << BZ_WIDE_SHIFT --*/
+   f = 0;
+   for (i = 0; i <= (nblock - 1) >> BZ_WIDE_SHIFT; i++) {
+      while ((UInt32)cf[f] <= ((UInt32)i << BZ_WIDE_SHIFT)) f++;
+      fb[i] = (UChar)f;
+   }
+
+   p = s->tPos;
+   for (i = 0; i + 1 < nblock; i += 2) {
+      e = tw[p];
+      f = fb[p >> BZ_WIDE_SHIFT];
+      f += (p >= (UInt32)cf[f]);
+      while (p >= (UInt32)cf[f]) f++;
+      tt[i]     = ((UInt32)(i + 1) << 8) | (e & 0xff);
+      tt[i + 1] = ((UInt32)(i + 2) << 8) | f;
+      p = e >> 8;
+   }
+   if (i < nblock) tt[i] = ((UInt32)(i + 1) << 8) | (tw[p] & 0xff);
+   s->tPos = 0;
 }
 
 
@@ -138,34 +576,9 @@ Int32 BZ2_decompress ( DState* s )
    Int32* gLimit;
    Int32* gBase;
    Int32* gPerm;
+   UInt16* gLookup;
 
-   if (s->state == BZ_X_MAGIC_1) {
-      /*initialise the save area*/
-      s->save_i           = 0;
-      s->save_j           = 0;
-      s->save_t           = 0;
-      s->save_alphaSize   = 0;
-      s->save_nGroups     = 0;
-      s->save_nSelectors  = 0;
-      s->save_EOB         = 0;
-      s->save_groupNo     = 0;
-      s->save_groupPos    = 0;
-      s->save_nextSym     = 0;
-      s->save_nblockMAX   = 0;
-      s->save_nblock      = 0;
-      s->save_es          = 0;
-      s->save_N           = 0;
-      s->save_curr        = 0;
-      s->save_zt          = 0;
-      s->save_zn          = 0;
-      s->save_zvec        = 0;
-      s->save_zj          = 0;
-      s->save_gSel        = 0;
-      s->save_gMinlen     = 0;
-      s->save_gLimit      = NULL;
-      s->save_gBase       = NULL;
-      s->save_gPerm       = NULL;
-   }
+   if (s->state == BZ_X_MAGIC_1) initSaveArea ( s );
 
    /*restore from the save area*/
    i           = s->save_i;
@@ -192,6 +605,7 @@ Int32 BZ2_decompress ( DState* s )
    gLimit      = s->save_gLimit;
    gBase       = s->save_gBase;
    gPerm       = s->save_gPerm;
+   gLookup     = s->save_gLookup;
 
    retVal = BZ_OK;
 
@@ -220,6 +634,10 @@ Int32 BZ2_decompress ( DState* s )
       } else {
          s->tt  = BZALLOC( s->blockSize100k * 100000 * sizeof(Int32) );
          if (s->tt == NULL) RETURN(BZ_MEM_ERROR);
+         if (s->wideDecompress) {
+            s->tw = BZALLOC( BZ_WIDE_BYTES(s->blockSize100k * 100000) );
+            if (s->tw == NULL) RETURN(BZ_MEM_ERROR);
+         }
       }
 
       GET_UCHAR(BZ_X_BLKHDR_1, uc);
@@ -349,6 +767,7 @@ Int32 BZ2_decompress ( DState* s )
             &(s->limit[t][0]),
             &(s->base[t][0]),
             &(s->perm[t][0]),
+            &(s->lookup[t][0]),
             &(s->len[t][0]),
             minLen, maxLen, alphaSize
          );
@@ -365,6 +784,10 @@ Int32 BZ2_decompress ( DState* s )
       for (i = 0; i <= 255; i++) s->unzftab[i] = 0;
 
       /*-- MTF init --*/
+#ifdef BZ_SSE2
+      for (i = 0; i <= 255; i++) s->mtfa[i] = (UChar)i;
+      s->mtfbase[0] = 0;
+#else
       {
          Int32 ii, jj, kk;
          kk = MTFA_SIZE-1;
@@ -376,6 +799,7 @@ Int32 BZ2_decompress ( DState* s )
             s->mtfbase[ii] = kk + 1;
          }
       }
+#endif
       /*-- end MTF init --*/
 
       nblock = 0;
@@ -383,6 +807,35 @@ Int32 BZ2_decompress ( DState* s )
 
       while (True) {
 
+         /*-- run free while the input cannot run out --*/
+         if (s->strm->avail_in >= BZ_FAST_MARGIN && nextSym != EOB) {
+            s->save_nSelectors = nSelectors;
+            s->save_EOB        = EOB;
+            s->save_nblockMAX  = nblockMAX;
+            s->save_nblock     = nblock;
+            s->save_nextSym    = nextSym;
+            s->save_groupNo    = groupNo;
+            s->save_groupPos   = groupPos;
+            s->save_gSel       = gSel;
+            s->save_gMinlen    = gMinlen;
+            s->save_gLimit     = gLimit;
+            s->save_gBase      = gBase;
+            s->save_gPerm      = gPerm;
+            s->save_gLookup    = gLookup;
+            retVal = decodeMTFFast ( s );
+            nblock   = s->save_nblock;
+            nextSym  = s->save_nextSym;
+            groupNo  = s->save_groupNo;
+            groupPos = s->save_groupPos;
+            gSel     = s->save_gSel;
+            gMinlen  = s->save_gMinlen;
+            gLimit   = s->save_gLimit;
+            gBase    = s->save_gBase;
+            gPerm    = s->save_gPerm;
+            gLookup  = s->save_gLookup;
+            if (retVal != BZ_OK) RETURN(retVal);
+         }
+
          if (nextSym == EOB) break;
 
          if (nextSym == BZ_RUNA || nextSym == BZ_RUNB) {
@@ -429,59 +882,7 @@ Int32 BZ2_decompress ( DState* s )
 
             if (nblock >= nblockMAX) RETURN(BZ_DATA_ERROR);
 
-            /*-- uc = MTF ( nextSym-1 ) --*/
-            {
-               Int32 ii, jj, kk, pp, lno, off;
-               UInt32 nn;
-               nn = (UInt32)(nextSym - 1);
-
-               if (nn < MTFL_SIZE) {
-                  /* avoid general-case expense */
-                  pp = s->mtfbase[0];
-                  uc = s->mtfa[pp+nn];
-                  while (nn > 3) {
-                     Int32 z = pp+nn;
-                     s->mtfa[(z)  ] = s->mtfa[(z)-1];
-                     s->mtfa[(z)-1] = s->mtfa[(z)-2];
-                     s->mtfa[(z)-2] = s->mtfa[(z)-3];
-                     s->mtfa[(z)-3] = s->mtfa[(z)-4];
-                     nn -= 4;
-                  }
-                  while (nn > 0) {
-                     s->mtfa[(pp+nn)] = s->mtfa[(pp+nn)-1]; nn--;
-                  };
-                  s->mtfa[pp] = uc;
-               } else {
-                  /* general case */
-                  lno = nn / MTFL_SIZE;
-                  off = nn % MTFL_SIZE;
-                  pp = s->mtfbase[lno] + off;
-                  uc = s->mtfa[pp];
-                  while (pp > s->mtfbase[lno]) {
-                     s->mtfa[pp] = s->mtfa[pp-1]; pp--;
-                  };
-                  s->mtfbase[lno]++;
-                  while (lno > 0) {
-                     s->mtfbase[lno]--;
-                     s->mtfa[s->mtfbase[lno]]
-                        = s->mtfa[s->mtfbase[lno-1] + MTFL_SIZE - 1];
-                     lno--;
-                  }
-                  s->mtfbase[0]--;
-                  s->mtfa[s->mtfbase[0]] = uc;
-                  if (s->mtfbase[0] == 0) {
-                     kk = MTFA_SIZE-1;
-                     for (ii = 256 / MTFL_SIZE-1; ii >= 0; ii--) {
-                        for (jj = MTFL_SIZE-1; jj >= 0; jj--) {
-                           s->mtfa[kk] = s->mtfa[s->mtfbase[ii] + jj];
-                           kk--;
-                        }
-                        s->mtfbase[ii] = kk + 1;
-                     }
-                  }
-               }
-            }
-            /*-- end uc = MTF ( nextSym-1 ) --*/
+            uc = mtfDecode ( s, nextSym );
 
             s->unzftab[s->seqToUnseq[uc]]++;
             if (s->smallDecompress)
@@ -573,6 +974,7 @@ Int32 BZ2_decompress ( DState* s )
          }
 
          s->tPos = s->tt[s->origPtr] >> 8;
+         if (s->wideDecompress) unBWT_wide ( s, nblock );
          s->nblock_used = 0;
          if (s->blockRandomised) {
             BZ_RAND_INIT_MASK;
@@ -645,6 +1047,7 @@ Int32 BZ2_decompress ( DState* s )
    s->save_gLimit      = gLimit;
    s->save_gBase       = gBase;
    s->save_gPerm       = gPerm;
+   s->save_gLookup     = gLookup;
 
    return retVal;
 }
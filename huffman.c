@@ -173,6 +173,7 @@ void BZ2_hbAssignCodes ( Int32 *code,
 void BZ2_hbCreateDecodeTables ( Int32 *limit,
                                 Int32 *base,
                                 Int32 *perm,
+                                UInt16 *lookup,
                                 UChar *length,
                                 Int32 minLen,
                                 Int32 maxLen,
@@ -200,6 +201,25 @@ void BZ2_hbCreateDecodeTables ( Int32 *limit,
    }
    for (i = minLen + 1; i <= maxLen; i++)
       base[i] = ((limit[i-1] + 1) << 1) - base[i];
+
+   /*--
+      For each value of the next BZ_LOOKUP_BITS bits, run
+      the bit-at-a-time search the decoder would, as far as
+      those bits go.  Entries it would not settle, or would
+      reject, stay 0 and are left to the decoder proper, so
+      even a malformed table decodes just as before.
+   --*/
+   for (vec = 0; vec < (1 << BZ_LOOKUP_BITS); vec++) {
+      lookup[vec] = 0;
+      for (i = minLen; i <= BZ_LOOKUP_BITS; i++) {
+         j = vec >> (BZ_LOOKUP_BITS - i);
+         if (j <= limit[i]) {
+            if (j - base[i] >= 0 && j - base[i] < BZ_MAX_ALPHA_SIZE)
+               lookup[vec] = (UInt16)(((j - base[i]) << 5) | i);
+            break;
+         }
+      }
+   }
 }
 
 
@@ -0,0 +1,267 @@
+
+/*-------------------------------------------------------------*/
+/*--- Work queue for the multi-threaded entry points        ---*/
+/*---                                            parallel.c ---*/
+/*-------------------------------------------------------------*/
+
+/* ------------------------------------------------------------------
+   This file is part of PT2ziplib/libzip2pt, a program and library for
+   lossless, block-sorting data compression.
+
+   bzip2/libbzip2 version 1.1.0 of 6 September 2010
+   Copyright (C) 1996-2010 Julian Seward <jseward@acm.org>
+
+   PT2ziplib/libzip2pt version 0.0.5-1 of 10 February 2026
+   Copyright (C) 2026 Project Tick.
+
+   Please read the WARNING, DISCLAIMER and PATENTS sections in the
+   README file.
+
+   This program is released under the terms of the license contained
+   in the file LICENSE.
+   ------------------------------------------------------------------ */
+
+
+#include "bzlib_private.h"
+
+#ifndef BZ_NO_THREADS
+#include <pthread.h>
+#endif
+
+
+/*--
+   A deliberately simple pool: a fixed set of threads
+   taking jobs off one FIFO.  Callers own the bz_job
+   structures and keep track of ordering themselves;
+   the pool only tells them when a job has finished.
+--*/
+
+struct bz_pool {
+   Int32           nThreads;
+#ifndef BZ_NO_THREADS
+   pthread_t*      thr;
+   pthread_mutex_t lock;
+   pthread_cond_t  work;
+   pthread_cond_t  finished;
+   bz_job*         head;
+   bz_job*         tail;
+   Bool            quit;
+#endif
+};
+
+
+#ifndef BZ_NO_THREADS
+
+/*---------------------------------------------------*/
+static
+void* pool_worker ( void* arg )
+{
+   bz_pool* p = (bz_pool*)arg;
+   bz_job*  j;
+
+   pthread_mutex_lock ( &p->lock );
+   while (True) {
+      while (p->head == NULL && !p->quit)
+         pthread_cond_wait ( &p->work, &p->lock );
+      if (p->head == NULL) break;
+
+      j = p->head;
+      p->head = j->next;
+      if (p->head == NULL) p->tail = NULL;
+      pthread_mutex_unlock ( &p->lock );
+
+      j->run ( j );
+
+      pthread_mutex_lock ( &p->lock );
+      j->done = True;
+      pthread_cond_broadcast ( &p->finished );
+   }
+   pthread_mutex_unlock ( &p->lock );
+   return NULL;
+}
+
+#endif
+
+
+/*---------------------------------------------------*/
+bz_pool* BZ2_poolCreate ( bz_stream* strm, Int32 nThreads )
+{
+   bz_pool* p;
+
+   p = BZALLOC( sizeof(bz_pool) );
+   if (p == NULL) return NULL;
+   p->nThreads = 0;
+
+#ifndef BZ_NO_THREADS
+   p->head = NULL;
+   p->tail = NULL;
+   p->quit = False;
+   p->thr  = BZALLOC( (size_t)nThreads * sizeof(pthread_t) );
+   if (p->thr == NULL) { BZFREE(p); return NULL; }
+
+   pthread_mutex_init ( &p->lock, NULL );
+   pthread_cond_init ( &p->work, NULL );
+   pthread_cond_init ( &p->finished, NULL );
+
+   /*-- Running with fewer threads than asked for is fine. --*/
+   while (p->nThreads < nThreads) {
+      if (pthread_create ( &p->thr[p->nThreads], NULL,
+                           pool_worker, p ) != 0) break;
+      p->nThreads++;
+   }
+#else
+   (void)nThreads;
+#endif
+
+   return p;
+}
+
+
+/*---------------------------------------------------*/
+void BZ2_poolSubmit ( bz_pool* p, bz_job* j )
+{
+   j->done = False;
+   j->next = NULL;
+
+#ifndef BZ_NO_THREADS
+   if (p->nThreads > 0) {
+      pthread_mutex_lock ( &p->lock );
+      if (p->tail == NULL) p->head = j; else p->tail->next = j;
+      p->tail = j;
+      pthread_cond_signal ( &p->work );
+      pthread_mutex_unlock ( &p->lock );
+      return;
+   }
+#else
+   (void)p;
+#endif
+
+   j->run ( j );
+   j->done = True;
+}
+
+
+/*---------------------------------------------------*/
+Bool BZ2_poolDone ( bz_pool* p, bz_job* j )
+{
+   Bool done;
+
+#ifndef BZ_NO_THREADS
+   if (p->nThreads > 0) {
+      pthread_mutex_lock ( &p->lock );
+      done = j->done;
+      pthread_mutex_unlock ( &p->lock );
+      return done;
+   }
+#else
+   (void)p;
+#endif
+
+   done = j->done;
+   return done;
+}
+
+
+/*---------------------------------------------------*/
+void BZ2_poolWait ( bz_pool* p, bz_job* j )
+{
+#ifndef BZ_NO_THREADS
+   if (p->nThreads > 0) {
+      pthread_mutex_lock ( &p->lock );
+      while (!j->done)
+         pthread_cond_wait ( &p->finished, &p->lock );
+      pthread_mutex_unlock ( &p->lock );
+   }
+#else
+   (void)p;
+   (void)j;
+#endif
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Takes j back off the queue if no thread has started
+   it yet, and otherwise waits for it to finish.  Either
+   way j has not run, or has finished, on return, so a
+   caller never blocks behind queued work.
+--*/
+void BZ2_poolCancel ( bz_pool* p, bz_job* j )
+{
+#ifndef BZ_NO_THREADS
+   bz_job* prev;
+   bz_job* q;
+
+   if (p->nThreads > 0) {
+      pthread_mutex_lock ( &p->lock );
+      prev = NULL;
+      for (q = p->head; q != NULL && q != j; q = q->next) prev = q;
+      if (q != NULL) {
+         if (prev == NULL) p->head = j->next; else prev->next = j->next;
+         if (p->tail == j) p->tail = prev;
+         j->done = True;
+      }
+      while (!j->done)
+         pthread_cond_wait ( &p->finished, &p->lock );
+      pthread_mutex_unlock ( &p->lock );
+   }
+#else
+   (void)p;
+   (void)j;
+#endif
+}
+
+
+/*---------------------------------------------------*/
+/*--
+   Returns (*next)++, atomically with respect to other
+   callers on the same pool, for handing out work items.
+--*/
+Int32 BZ2_poolClaim ( bz_pool* p, Int32* next )
+{
+   Int32 k;
+
+#ifndef BZ_NO_THREADS
+   if (p->nThreads > 0) {
+      pthread_mutex_lock ( &p->lock );
+      k = (*next)++;
+      pthread_mutex_unlock ( &p->lock );
+      return k;
+   }
+#else
+   (void)p;
+#endif
+
+   k = (*next)++;
+   return k;
+}
+
+
+/*---------------------------------------------------*/
+void BZ2_poolDestroy ( bz_stream* strm, bz_pool* p )
+{
+#ifndef BZ_NO_THREADS
+   Int32 i;
+
+   /*-- Workers drain the queue before they look at quit. --*/
+   pthread_mutex_lock ( &p->lock );
+   p->quit = True;
+   pthread_cond_broadcast ( &p->work );
+   pthread_mutex_unlock ( &p->lock );
+
+   for (i = 0; i < p->nThreads; i++)
+      pthread_join ( p->thr[i], NULL );
+
+   pthread_cond_destroy ( &p->finished );
+   pthread_cond_destroy ( &p->work );
+   pthread_mutex_destroy ( &p->lock );
+   BZFREE(p->thr);
+#endif
+
+   BZFREE(p);
+}
+
+
+/*-------------------------------------------------------------*/
+/*--- end                                        parallel.c ---*/
+/*-------------------------------------------------------------*/
@@ -47,6 +47,23 @@ class TC(testcase.TestCase):
             # Check that bzip2 thinks it succeeded.
             assert ec == 0
 
+            # The sample's .bz2 was made by the reference bzip2 at one block
+            # size. At that size the output must match it byte for byte.
+            reference_path = sample.parent / (sample.stem + '.bz2')
+            if reference_path.exists():
+                reference = reference_path.read_bytes()
+                if reference[3:4] == str(abs(block_size)).encode():
+                    assert out == reference, \
+                        f'output differs from {reference_path.name}'
+
+            # Neither the thread count nor the block sorter may change a
+            # single byte of the output.
+            for threads in ['-T1', '-T4', '--linear-sort']:
+                cmd = [str(TC.bzip2), '--compress', str(block_size), threads, '--keep', '--stdout', str(sample)]
+                (ec, out_t, err) = self.execute(cmd, try_valgrind=TRY_VALGRIND)
+                assert ec == 0
+                assert out_t == out, f'output with {threads} differs from the default'
+
             # Write it to a temp file
             tempfile_path = TC.path_tmp / (sample.name + '.bz2')
             print(f'Writing compressed {sample.name} file to disk as {tempfile_path.name}...')
@@ -106,6 +123,18 @@ class TC(testcase.TestCase):
                     'decompression output and reference file differ:\n' + \
                     TC.hex_compare(out, refcontents)
 
+                # Decoding blocks in parallel, or two bytes per lookup, must give
+                # the same output, and pass -t.
+                for threads in [['-T1'], ['-T4'], ['-T1', '--wide-table']]:
+                    cmd = [str(TC.bzip2), '--decompress', *threads, '--keep', '--stdout', str(sample)]
+                    (ec, out_t, err) = self.execute(cmd, try_valgrind=TRY_VALGRIND)
+                    assert ec == 0
+                    assert out_t == out, f'output with {" ".join(threads)} differs from the default'
+
+                    cmd = [str(TC.bzip2), '--test', *threads, str(sample)]
+                    (ec, out_t, err) = self.execute(cmd, try_valgrind=TRY_VALGRIND)
+                    assert ec == 0
+
 
 # loop through directories in 'bzip2/tests/input/quick'...
 #